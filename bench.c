@@ -0,0 +1,391 @@
+#include "common.h"
+#include "protocol.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+
+#define MAX_SIZES 16
+
+// How long to wait for a server that is still starting up
+#define CONNECT_ATTEMPTS 100
+#define CONNECT_DELAY_NS (20 * 1000 * 1000)
+
+/*
+ * Sizes of the uploaded files and their relative weights
+ */
+struct SizeDistribution
+{
+    uint64_t sizes[MAX_SIZES];
+    uint64_t limits[MAX_SIZES];
+    uint64_t totalWeight;
+    int count;
+};
+
+/*
+ * One connection of the load and what it measured
+ */
+struct BenchStream
+{
+    const struct sockaddr_storage *storage;
+    const struct SizeDistribution *distribution;
+    const char *content;
+    int index;
+    int files;
+    int abandon;
+    uint64_t seed;
+    double *latencies;
+    uint64_t bytes;
+    int errors;
+    pthread_t thread;
+};
+
+/**
+ * Prints the usage of the benchmark program
+ *
+ * - argv: An array of command-line argument strings
+ */
+void benchUsage(char **argv)
+{
+    printf("usage: %s [-c connections] [-n files] [-s sizes] [-a] <server IP> <server port>\n", argv[0]);
+    printf("  -c  number of concurrent connections (default 8)\n");
+    printf("  -n  number of files uploaded by each connection (default 100)\n");
+    printf("  -s  file sizes as size[:weight],... with K, M or G suffixes\n");
+    printf("      (default 4K:70,64K:25,1M:5)\n");
+    printf("  -a  upload every file over a new connection, closed without waiting for the reply\n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Read a size such as 512, 4K, 64M or 1G, leaving `end` after it.
+ * Returns the size in bytes, 0 if it is not valid.
+ */
+uint64_t parseSize(const char *text, char **end)
+{
+    uint64_t size = strtoull(text, end, 10);
+    switch (**end)
+    {
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'K':
+        size *= 1024;
+        (*end)++;
+        break;
+    }
+    return size;
+}
+
+/*
+ * Read a size distribution such as "4K:70,64K:25,1M:5". A size without a
+ * weight has a weight of 1.
+ * Returns 0 on success, -1 if it is not valid.
+ */
+int parseDistribution(const char *text, struct SizeDistribution *distribution)
+{
+    distribution->count = 0;
+    distribution->totalWeight = 0;
+
+    char *end = (char *)text;
+    while (*end != '\0')
+    {
+        uint64_t size = parseSize(end, &end);
+        uint64_t weight = 1;
+        if (*end == ':')
+        {
+            weight = strtoull(end + 1, &end, 10);
+        }
+        if (size == 0 || weight == 0 || distribution->count == MAX_SIZES ||
+            (*end != ',' && *end != '\0'))
+        {
+            return -1;
+        }
+        if (*end == ',')
+        {
+            end++;
+        }
+
+        distribution->totalWeight += weight;
+        distribution->sizes[distribution->count] = size;
+        distribution->limits[distribution->count] = distribution->totalWeight;
+        distribution->count++;
+    }
+    return distribution->count > 0 ? 0 : -1;
+}
+
+/*
+ * Next number of a xorshift generator, enough to pick sizes.
+ */
+uint64_t nextRandom(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+ * Draw the size of the next file from the distribution.
+ */
+uint64_t pickSize(const struct SizeDistribution *distribution, uint64_t *seed)
+{
+    uint64_t draw = nextRandom(seed) % distribution->totalWeight;
+    int i = 0;
+    while (draw >= distribution->limits[i])
+    {
+        i++;
+    }
+    return distribution->sizes[i];
+}
+
+/*
+ * Monotonic time in seconds.
+ */
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Connect to the server, retrying for a while in case it is still starting.
+ * Returns the socket, or -1 on failure.
+ */
+int connectServer(const struct sockaddr_storage *storage)
+{
+    struct timespec delay = {0, CONNECT_DELAY_NS};
+    for (int attempt = 0; attempt < CONNECT_ATTEMPTS; attempt++)
+    {
+        int s = socket(storage->ss_family, SOCK_STREAM, 0);
+        if (s == -1)
+        {
+            return -1;
+        }
+        if (connect(s, (const struct sockaddr *)storage, sizeof(*storage)) == 0)
+        {
+            return s;
+        }
+        close(s);
+        nanosleep(&delay, NULL);
+    }
+    return -1;
+}
+
+/*
+ * Upload one file and, if `wait` is set, wait for its reply.
+ * Returns 0 if the server stored it, or the file was sent without waiting,
+ * -1 otherwise.
+ */
+int uploadFile(int s, const char *name, const char *content, uint64_t size, int wait)
+{
+    struct FrameHeader header;
+    unsigned char raw[FRAME_HEADER_SIZE];
+    initHeader(&header, OP_SEND, strlen(name), size);
+    encodeHeader(&header, raw);
+
+    // One writev per file, so the header never waits for an acknowledgement
+    struct iovec iov[3] = {
+        {raw, FRAME_HEADER_SIZE},
+        {(void *)name, strlen(name)},
+        {(void *)content, size},
+    };
+    if (sendAllv(s, iov, 3) != 0)
+    {
+        return -1;
+    }
+    if (!wait)
+    {
+        return 0;
+    }
+
+    char message[MAX_NAME_LENGTH + 32];
+    if (recvHeader(s, &header) != 0 || header.opcode != OP_REPLY ||
+        header.payloadLength > sizeof(message) ||
+        recvAll(s, message, header.payloadLength) != 0)
+    {
+        return -1;
+    }
+    return header.status == STATUS_RECEIVED || header.status == STATUS_OVERWRITTEN ? 0 : -1;
+}
+
+/*
+ * Upload the files of one connection, measuring the time from the first
+ * byte of each file to its reply. Abandoned connections are replaced for
+ * every file, so the server sees clients leave while their files are still
+ * being written. Runs in its own thread.
+ */
+void *runStream(void *arg)
+{
+    struct BenchStream *stream = arg;
+
+    int s = connectServer(stream->storage);
+    if (s == -1)
+    {
+        stream->errors = stream->files;
+        return NULL;
+    }
+
+    for (int i = 0; i < stream->files; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "bench-%d-%d.txt", stream->index, i);
+        uint64_t size = pickSize(stream->distribution, &stream->seed);
+
+        if (stream->abandon && i > 0)
+        {
+            close(s);
+            s = connectServer(stream->storage);
+            if (s == -1)
+            {
+                stream->errors += stream->files - i;
+                return NULL;
+            }
+        }
+
+        double start = now();
+        if (uploadFile(s, name, stream->content, size, !stream->abandon) != 0)
+        {
+            // The connection is out of sync, count what is left as failed
+            stream->errors += stream->files - i;
+            close(s);
+            return NULL;
+        }
+        stream->latencies[i] = now() - start;
+        stream->bytes += size;
+    }
+
+    if (!stream->abandon)
+    {
+        sendFrame(s, OP_EXIT, 0, NULL, NULL, 0);
+    }
+    close(s);
+    return NULL;
+}
+
+int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of sorted values, in milliseconds.
+ */
+double percentile(const double *sorted, size_t count, double p)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t rank = (size_t)(p * count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0] * 1000;
+}
+
+int main(int argc, char **argv)
+{
+    int connections = 8;
+    int files = 100;
+    const char *sizes = "4K:70,64K:25,1M:5";
+    int abandon = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:s:a")) != -1)
+    {
+        if (opt == 'c' && atoi(optarg) > 0)
+            connections = atoi(optarg);
+        else if (opt == 'n' && atoi(optarg) > 0)
+            files = atoi(optarg);
+        else if (opt == 's')
+            sizes = optarg;
+        else if (opt == 'a')
+            abandon = 1;
+        else
+            benchUsage(argv);
+    }
+
+    struct SizeDistribution distribution;
+    struct sockaddr_storage storage;
+    if (argc - optind < 2 || parseDistribution(sizes, &distribution) != 0 ||
+        addrparse(argv[optind], argv[optind + 1], &storage) != 0)
+    {
+        benchUsage(argv);
+    }
+
+    // The content of every file is a prefix of one random buffer
+    uint64_t largest = 0;
+    for (int i = 0; i < distribution.count; i++)
+    {
+        largest = distribution.sizes[i] > largest ? distribution.sizes[i] : largest;
+    }
+    uint64_t seed;
+    char *content = malloc(largest);
+    struct BenchStream *streams = calloc(connections, sizeof(*streams));
+    double *latencies = malloc((size_t)connections * files * sizeof(double));
+    if (content == NULL || streams == NULL || latencies == NULL ||
+        getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+    {
+        exit(EXIT_FAILURE);
+    }
+    seed |= 1;
+    for (uint64_t i = 0; i < largest; i += sizeof(uint64_t))
+    {
+        uint64_t word = nextRandom(&seed);
+        memcpy(content + i, &word, largest - i < sizeof(word) ? largest - i : sizeof(word));
+    }
+
+    double start = now();
+    for (int i = 0; i < connections; i++)
+    {
+        struct BenchStream *stream = &streams[i];
+        stream->storage = &storage;
+        stream->distribution = &distribution;
+        stream->content = content;
+        stream->index = i;
+        stream->files = files;
+        stream->abandon = abandon;
+        stream->seed = nextRandom(&seed) | 1;
+        stream->latencies = latencies + (size_t)i * files;
+        if (pthread_create(&stream->thread, NULL, runStream, stream) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Gather the latencies of the uploaded files back to back
+    size_t measured = 0;
+    uint64_t bytes = 0;
+    int errors = 0;
+    for (int i = 0; i < connections; i++)
+    {
+        struct BenchStream *stream = &streams[i];
+        pthread_join(stream->thread, NULL);
+        size_t done = stream->files - stream->errors;
+        memmove(latencies + measured, stream->latencies, done * sizeof(double));
+        measured += done;
+        bytes += stream->bytes;
+        errors += stream->errors;
+    }
+    double seconds = now() - start;
+
+    qsort(latencies, measured, sizeof(double), compareDoubles);
+    printf("{\"connections\": %d, \"files\": %zu, \"errors\": %d, \"bytes\": %llu, "
+           "\"seconds\": %.3f, \"mb_per_second\": %.2f, \"files_per_second\": %.1f, "
+           "\"latency_ms\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f}}\n",
+           connections, measured, errors, (unsigned long long)bytes, seconds,
+           bytes / seconds / 1e6, measured / seconds, percentile(latencies, measured, 0.50),
+           percentile(latencies, measured, 0.99), percentile(latencies, measured, 0.999));
+
+    exit(errors > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
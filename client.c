@@ -1,104 +1,1214 @@
 #include "common.h"
+#include "compress.h"
+#include "crc32c.h"
+#include "delta.h"
+#include "filter.h"
+#include "protocol.h"
+#include "sha256.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <string.h>
-#include <ctype.h>
+#include <dirent.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <endian.h>
+#include <fcntl.h>
 
 // socket libraries:
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <arpa/inet.h>
 
 #define SIZEOPTION 12
+#define SIZESENDDIR 9
+#define SIZESENDGLOB 10
+#define SIZEGETFILE 9
+
+// Files up to this size are packed into bundles when bundling is enabled
+#define BUNDLE_FILE_MAX (64 * 1024)
+
+// Files at least this large are split across the parallel streams
+#define PARALLEL_MIN (8 * 1024 * 1024)
+#define MAX_STREAMS 64
+
+// Lookups sent before reading their replies, so neither side's buffers fill up
+#define LOOKUP_WINDOW 256
+
+// Times a corrupted file is resent before giving up on it
+#define CHECK_RETRIES 3
+
+/*
+ * State of a batch being sent: the order in which the server will report
+ * the files, and the bundle of small files not sent yet.
+ */
+struct Batch
+{
+    size_t *order;
+    size_t sent;
+    size_t *members;
+    uint32_t memberCount;
+    char index[BUNDLE_MAX];
+    size_t indexLength;
+    char data[BUNDLE_MAX];
+    size_t dataLength;
+};
 #define BUFSZ 500
 
 void clientUsage(int argc, char **argv)
 {
-    printf("usage: %s <server IP> <server port>\n", argv[0]);
+    printf("usage: %s [-f] [-b] [-r] [-d] [-D] [-p streams] [-z|-Z] [-c] <server IP> <server port>\n", argv[0]);
+    printf("  -f  remove special characters from the content before sending\n");
+    printf("  -b  pack the small files of send dir/glob into bundles\n");
+    printf("  -r  resume an interrupted send file where the server left off\n");
+    printf("  -d  skip sending files whose content the server already stores\n");
+    printf("  -D  send only the changes when the server has an older copy of the file\n");
+    printf("  -p  send large files as ranges over this many parallel connections,\n");
+    printf("      neither compressed nor checksummed\n");
+    printf("  -z  compress the content, -Z compresses harder but slower\n");
+    printf("  -c  checksum uncompressed content and resend what arrives corrupted\n");
     exit(EXIT_FAILURE);
 }
 
 /*
- * Remove special characters, except line breaks and spaces
+ * Count the bytes of the file that survive removeSpecialCharacters, so the
+ * frame length is known before the content is streamed.
+ * Parameters:
+ *   - fp: file pointer, rewound before returning
+ *   - chunk: scratch buffer of CHUNKSZ bytes
+ */
+uint64_t filteredLength(FILE *fp, char *chunk)
+{
+    uint64_t length = 0;
+    size_t bytesRead;
+
+    while ((bytesRead = fread(chunk, sizeof(char), CHUNKSZ, fp)) > 0)
+    {
+        length += removeSpecialCharacters(chunk, bytesRead);
+    }
+    rewind(fp);
+    return length;
+}
+
+/*
+ * Hash the content of the file as it will be sent.
+ * Parameters:
+ *   - fp: file pointer, rewound before returning
+ *   - filter: whether special characters are removed from the content
+ *   - digest: the SHA-256 of the content
+ */
+void hashContent(FILE *fp, int filter, unsigned char digest[SHA256_SIZE])
+{
+    static char chunk[CHUNKSZ];
+    struct Sha256 ctx;
+    size_t bytesRead;
+
+    sha256Init(&ctx);
+    while ((bytesRead = fread(chunk, sizeof(char), CHUNKSZ, fp)) > 0)
+    {
+        if (filter)
+        {
+            bytesRead = removeSpecialCharacters(chunk, bytesRead);
+        }
+        sha256Update(&ctx, chunk, bytesRead);
+    }
+    sha256Final(&ctx, digest);
+    rewind(fp);
+}
+
+/*
+ * Send an OP_LOOKUP frame announcing the hash of the file, so the server can
+ * create it from its content store. Exits if there was an error.
  */
-int isSpecialCharacter(char c)
+void sendLookup(const char *path, FILE *fp, int s, int filter)
 {
-    if (isalnum(c) || c == ' ' || c == '\n')
+    unsigned char digest[SHA256_SIZE];
+    hashContent(fp, filter, digest);
+
+    const char *baseName = strrchr(path, '/');
+    baseName = baseName != NULL ? baseName + 1 : path;
+    if (sendFrame(s, OP_LOOKUP, 0, baseName, digest, SHA256_SIZE) != 0)
     {
-        return 0;
+        exit(EXIT_FAILURE);
     }
-    return 1;
 }
 
-void removeSpecialCharacters(char *str)
+/*
+ * Send `length` bytes of the file starting at `offset` straight from the
+ * page cache with sendfile(2), so the content never passes through user space.
+ * Returns 0 on success, -1 on failure.
+ */
+int sendFileZeroCopy(int s, int fd, off_t offset, uint64_t length)
 {
-    int i, j;
-    for (i = 0, j = 0; str[i] != '\0'; i++)
+    while (length > 0)
     {
-        if (!isSpecialCharacter(str[i]))
+        size_t wanted = length < 0x7ffff000 ? (size_t)length : 0x7ffff000;
+        ssize_t count = sendfile(s, fd, &offset, wanted);
+        if (count <= 0)
         {
-            str[j++] = str[i];
+            return -1;
         }
+        length -= count;
     }
-    str[j] = '\0';
+    return 0;
 }
 
 /*
- * Send a message through the socket.
+ * Stream the content compressed, chunk by chunk, ending it with a CHUNK_END
+ * word. Chunks that do not shrink are stored raw.
  * Parameters:
- *   s: socket
- *   buf: buffer containing the message
+ *   - fp: file pointer of the file
+ *   - filter: whether special characters are removed from the content
+ *   - skip: bytes of the content, as sent, already held by the server
+ *   - remaining: bytes of the content left to send
+ *   - level: COMPRESS_FAST or COMPRESS_HIGH
+ * Exits if there was an error.
  */
+void sendCompressed(int s, FILE *fp, int filter, uint64_t skip, uint64_t remaining, int level)
+{
+    static char chunk[CHUNKSZ];
+    static unsigned char packed[CHUNK_HEADER_SIZE + CHUNKSZ];
+
+    while (remaining > 0)
+    {
+        size_t bytesRead = fread(chunk, sizeof(char), CHUNKSZ, fp);
+        if (bytesRead == 0)
+        {
+            // The file shrank after its length was announced
+            exit(EXIT_FAILURE);
+        }
+        if (filter)
+        {
+            bytesRead = removeSpecialCharacters(chunk, bytesRead);
+        }
+
+        size_t skipped = skip < bytesRead ? (size_t)skip : bytesRead;
+        skip -= skipped;
+        bytesRead -= skipped;
+        if (bytesRead > remaining)
+        {
+            bytesRead = remaining;
+        }
+        if (bytesRead == 0)
+        {
+            continue;
+        }
+
+        const unsigned char *raw = (const unsigned char *)chunk + skipped;
+        size_t stored = compressChunk(raw, bytesRead, packed + CHUNK_HEADER_SIZE, bytesRead - 1, level);
+        uint32_t word = htonl(stored > 0 ? stored | CHUNK_COMPRESSED : bytesRead);
+        if (stored == 0)
+        {
+            memcpy(packed + CHUNK_HEADER_SIZE, raw, bytesRead);
+            stored = bytesRead;
+        }
+        memcpy(packed, &word, CHUNK_HEADER_SIZE);
+        if (sendAll(s, packed, CHUNK_HEADER_SIZE + stored) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        remaining -= bytesRead;
+    }
+
+    uint32_t end = htonl(CHUNK_END);
+    if (sendAll(s, &end, CHUNK_HEADER_SIZE) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
 
 /*
- * Send a file through the socket.
+ * Stream the content as checked chunks of CHUNKSZ bytes, each followed by
+ * its CRC32C, computed while the bytes are copied into the chunk.
  * Parameters:
- *   - buf: buffer to store the data to be sent
- *   - fileNameCount: length of the file name extracted from the command
- *   - fileNameExtracted: extracted file name from the command
+ *   - fp: file pointer of the file, at its start
+ *   - filter: whether special characters are removed from the content
+ *   - skip: bytes of the content, as sent, already held by the server
+ *   - remaining: bytes of the content left to send
+ * Exits if there was an error.
+ */
+void sendChecked(int s, FILE *fp, int filter, uint64_t skip, uint64_t remaining)
+{
+    static char raw[CHUNKSZ];
+    static char chunk[CHUNKSZ];
+    size_t rawLength = 0;
+    size_t rawStart = 0;
+    size_t filled = 0;
+    uint32_t crc = 0;
+
+    while (remaining > 0)
+    {
+        if (rawStart == rawLength)
+        {
+            rawLength = fread(raw, sizeof(char), CHUNKSZ, fp);
+            if (rawLength == 0)
+            {
+                // The file shrank after its length was announced
+                exit(EXIT_FAILURE);
+            }
+            if (filter)
+            {
+                rawLength = removeSpecialCharacters(raw, rawLength);
+            }
+
+            // Drop what the server already has
+            rawStart = skip < rawLength ? (size_t)skip : rawLength;
+            skip -= rawStart;
+            continue;
+        }
+
+        size_t chunkLength = remaining < CHUNKSZ ? (size_t)remaining : CHUNKSZ;
+        size_t piece = chunkLength - filled;
+        piece = piece < rawLength - rawStart ? piece : rawLength - rawStart;
+        crc = crc32cCopy(crc, chunk + filled, raw + rawStart, piece);
+        filled += piece;
+        rawStart += piece;
+
+        if (filled == chunkLength)
+        {
+            uint32_t word = htonl(crc);
+            struct iovec iov[2] = {{chunk, filled}, {&word, CHECKSUM_SIZE}};
+            if (sendAllv(s, iov, 2) != 0)
+            {
+                exit(EXIT_FAILURE);
+            }
+            remaining -= filled;
+            filled = 0;
+            crc = 0;
+        }
+    }
+}
+
+/*
+ * Agree with the server on the capabilities of the connection.
+ * Returns the capabilities both sides support, exits if there was an error.
+ */
+uint32_t negotiateCapabilities(int s, uint32_t wanted)
+{
+    uint32_t capabilities = htonl(wanted);
+    if (sendFrame(s, OP_HELLO, 0, NULL, &capabilities, HELLO_SIZE) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    struct FrameHeader header;
+    if (recvHeader(s, &header) != 0 || header.opcode != OP_REPLY ||
+        header.status != STATUS_HELLO || header.payloadLength != HELLO_SIZE ||
+        header.nameLength != 0 || recvAll(s, &capabilities, HELLO_SIZE) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    return ntohl(capabilities) & wanted;
+}
+
+/*
+ * Ask the server how many bytes of an interrupted upload it already holds.
+ * Parameters:
+ *   - s: socket descriptor
+ *   - baseName: name of the file on the server
+ *   - length: full length of the content to be sent
+ * Returns:
+ *   - the offset to resume from, 0 to send everything
+ *   - exits if there was an error
+ */
+uint64_t negotiateResume(int s, const char *baseName, uint64_t length)
+{
+    uint64_t wire = htobe64(length);
+    if (sendFrame(s, OP_RESUME, 0, baseName, &wire, sizeof(wire)) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    struct FrameHeader header;
+    if (recvHeader(s, &header) != 0 || header.opcode != OP_REPLY ||
+        header.status != STATUS_RESUME || header.nameLength != 0 ||
+        header.payloadLength != sizeof(wire) || recvAll(s, &wire, sizeof(wire)) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t offset = be64toh(wire);
+    return offset <= length ? offset : 0;
+}
+
+/*
+ * Send a file through the socket as one OP_SEND frame. The content goes
+ * through sendfile(2) unless it has to be filtered or checked, in which case
+ * it is streamed in CHUNKSZ blocks; either way memory use does not depend on
+ * the file size.
+ * Parameters:
+ *   - fileNameExtracted: name of the file, sent without its directory
  *   - fp: file pointer of the file to be sent
  *   - s: socket descriptor
+ *   - filter: whether special characters are removed from the content
+ *   - resume: whether to skip what the server kept of an interrupted upload
+ *   - level: compression level, 0 to send the content as is
+ *   - checked: whether uncompressed content is sent as checked chunks
  * Returns:
  *   - 0 if the file is sent successfully
  *   - exits if there was an error
  */
 
-int sendFile(char *buf, int fileNameCount, const char *fileNameExtracted, FILE *fp, int s)
+int sendFile(const char *fileNameExtracted, FILE *fp, int s, int filter, int resume, int level,
+             int checked)
+{
+    static char chunk[CHUNKSZ];
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t remaining = filter ? filteredLength(fp, chunk) : (uint64_t)st.st_size;
+
+    const char *baseName = strrchr(fileNameExtracted, '/');
+    baseName = baseName != NULL ? baseName + 1 : fileNameExtracted;
+
+    // Offsets count bytes as sent, that is after filtering
+    uint64_t skip = resume ? negotiateResume(s, baseName, remaining) : 0;
+    remaining -= skip;
+    if (skip > 0)
+    {
+        printf("resuming %s at byte %llu\n", baseName, (unsigned long long)skip);
+    }
+
+    // Hold the header back so it leaves in the same segment as the content
+    int cork = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+    if (level)
+    {
+        // The compressed length is not known up front, the content ends itself
+        if (sendFrameHeader(s, OP_SEND, SEND_COMPRESSED | (resume ? SEND_RESUME : 0), baseName,
+                            0) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        sendCompressed(s, fp, filter, skip, remaining, level);
+        remaining = 0;
+    }
+    else if (checked)
+    {
+        uint64_t chunks = (remaining + CHUNKSZ - 1) / CHUNKSZ;
+        if (sendFrameHeader(s, OP_SEND, SEND_CHECKED | (resume ? SEND_RESUME : 0), baseName,
+                            remaining + chunks * CHECKSUM_SIZE) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        sendChecked(s, fp, filter, skip, remaining);
+        remaining = 0;
+    }
+    else if (sendFrameHeader(s, OP_SEND, resume ? SEND_RESUME : 0, baseName, remaining) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (!filter && remaining > 0)
+    {
+        if (sendFileZeroCopy(s, fileno(fp), skip, remaining) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        remaining = 0;
+    }
+
+    while (remaining > 0)
+    {
+        size_t bytesRead = fread(chunk, sizeof(char), CHUNKSZ, fp);
+        if (bytesRead == 0)
+        {
+            // The file shrank after its length was announced
+            exit(EXIT_FAILURE);
+        }
+
+        if (filter)
+        {
+            bytesRead = removeSpecialCharacters(chunk, bytesRead);
+        }
+
+        // Drop what the server already has
+        size_t skipped = skip < bytesRead ? (size_t)skip : bytesRead;
+        skip -= skipped;
+        bytesRead -= skipped;
+
+        if (bytesRead > remaining)
+        {
+            bytesRead = remaining;
+        }
+
+        if (sendAll(s, chunk + skipped, bytesRead) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        remaining -= bytesRead;
+    }
+
+    cork = 0;
+    setsockopt(s, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+    return 0;
+}
+
+/*
+ * Ask the server for the block signatures of its copy of a file.
+ * Parameters:
+ *   - baseName: name of the file on the server
+ *   - blockSize, basisLength: receive the layout of the server's copy
+ * Returns:
+ *   - the signatures, to be freed, or NULL if the server has no copy
+ *   - exits if there was an error
+ */
+unsigned char *recvSignatures(int s, const char *baseName, uint32_t *blockSize,
+                              uint64_t *basisLength)
 {
-    int i = 0;
-    char buffer[BUFSZ];
-    char finalBuffer[BUFSZ];
-    int readCount = 0;
-    int maxSize = BUFSZ - fileNameCount - strlen("\\end");
+    if (sendFrame(s, OP_SIGNATURE, 0, baseName, NULL, 0) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
 
-    int bytesRead = fread(buffer, sizeof(char), maxSize, fp);
+    struct FrameHeader header;
+    unsigned char layout[DELTA_HEADER_SIZE];
+    if (recvHeader(s, &header) != 0 || header.opcode != OP_REPLY ||
+        header.status != STATUS_SIGNATURES || header.nameLength != 0 ||
+        header.payloadLength < DELTA_HEADER_SIZE || recvAll(s, layout, DELTA_HEADER_SIZE) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(blockSize, layout, 4);
+    memcpy(basisLength, layout + 4, 8);
+    *blockSize = be32toh(*blockSize);
+    *basisLength = be64toh(*basisLength);
 
-    removeSpecialCharacters(buffer);
+    uint64_t size = header.payloadLength - DELTA_HEADER_SIZE;
+    if (*blockSize == 0)
+    {
+        return NULL;
+    }
+    if (*blockSize < DELTA_BLOCK_MIN || *blockSize > DELTA_BLOCK_MAX ||
+        size != (*basisLength + *blockSize - 1) / *blockSize * DELTA_SIGNATURE_SIZE)
+    {
+        exit(EXIT_FAILURE);
+    }
 
-    strcpy(finalBuffer, fileNameExtracted);
+    unsigned char *signatures = malloc(size);
+    if (signatures == NULL || recvAll(s, signatures, size) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    return signatures;
+}
 
-    strcat(finalBuffer, buffer);
+/*
+ * Send a file as a delta against the server's copy: the server sends the
+ * signatures of its blocks, and only the bytes that match none of them are
+ * sent, the rest as block references.
+ * Parameters:
+ *   - fileNameExtracted: name of the file, sent without its directory
+ *   - fp: file pointer of the file to be sent
+ *   - s: socket descriptor
+ *   - filter: whether special characters are removed from the content
+ * Returns:
+ *   - 0 if the delta was sent
+ *   - -1 if the server has no copy, so the whole file must be sent
+ *   - exits if there was an error
+ */
+int sendDelta(const char *fileNameExtracted, FILE *fp, int s, int filter)
+{
+    static char chunk[CHUNKSZ];
 
-    strcat(finalBuffer, "\\end");
+    const char *baseName = strrchr(fileNameExtracted, '/');
+    baseName = baseName != NULL ? baseName + 1 : fileNameExtracted;
 
-    strcpy(buf, finalBuffer);
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0)
+    {
+        return -1;
+    }
+
+    uint32_t blockSize;
+    uint64_t basisLength;
+    unsigned char *signatures = recvSignatures(s, baseName, &blockSize, &basisLength);
+    if (signatures == NULL)
+    {
+        return -1;
+    }
+
+    // The delta is computed over the content as sent, filtered into a
+    // temporary file first if needed
+    FILE *content = fp;
+    if (filter)
+    {
+        content = tmpfile();
+        size_t bytesRead;
+        while (content != NULL && (bytesRead = fread(chunk, sizeof(char), CHUNKSZ, fp)) > 0)
+        {
+            bytesRead = removeSpecialCharacters(chunk, bytesRead);
+            if (fwrite(chunk, sizeof(char), bytesRead, content) != bytesRead)
+            {
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (content == NULL || fflush(content) != 0 || fstat(fileno(content), &st) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    int count = send(s, buf, strlen(buf), 0);
+    unsigned char *data = NULL;
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(content), 0);
+        if (data == MAP_FAILED)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    if (count != strlen(buf))
+    FILE *delta = tmpfile();
+    struct stat deltaSt;
+    if (delta == NULL ||
+        deltaEncode(data, st.st_size, signatures, blockSize, basisLength, delta) != 0 ||
+        fflush(delta) != 0 || fstat(fileno(delta), &deltaSt) != 0)
     {
         exit(EXIT_FAILURE);
     }
+    if (data != NULL)
+    {
+        munmap(data, st.st_size);
+    }
+    if (content != fp)
+    {
+        fclose(content);
+    }
+    free(signatures);
 
-    memset(buf, 0, BUFSZ);
+    // Nothing matched: the plain content is smaller
+    if ((uint64_t)deltaSt.st_size >= (uint64_t)st.st_size)
+    {
+        fclose(delta);
+        rewind(fp);
+        return -1;
+    }
+
+    printf("sending %s as a delta of %llu bytes instead of %llu\n", baseName,
+           (unsigned long long)deltaSt.st_size, (unsigned long long)st.st_size);
 
+    int cork = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    if (sendFrameHeader(s, OP_DELTA, 0, baseName, deltaSt.st_size) != 0 ||
+        sendFileZeroCopy(s, fileno(delta), 0, deltaSt.st_size) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    cork = 0;
+    setsockopt(s, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+    fclose(delta);
     return 0;
 }
 
+/*
+ * Receive an OP_REPLY frame and store its message in buf.
+ * Returns the status code of the reply, exits if there was an error.
+ */
+int recvReply(int s, char *buf)
+{
+    struct FrameHeader header;
+    if (recvHeader(s, &header) != 0 || header.opcode != OP_REPLY ||
+        header.nameLength != 0 || header.payloadLength >= BUFSZ)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (recvAll(s, buf, header.payloadLength) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    buf[header.payloadLength] = '\0';
+
+    return header.status;
+}
+
+/*
+ * Resend a file the server found corrupted from its first bad chunk, until
+ * it is stored or was resent CHECK_RETRIES times.
+ * Parameters:
+ *   - path: the file
+ *   - fp: file pointer of the file
+ *   - status: the status of the reply to the previous send
+ *   - buf: receives the message of the last reply
+ * Returns the status of the last reply, exits if there was an error.
+ */
+uint32_t resendCorrupted(const char *path, FILE *fp, int s, int filter, uint32_t status, char *buf)
+{
+    for (int retry = 0; status == STATUS_CORRUPT && retry < CHECK_RETRIES; retry++)
+    {
+        printf("resending corrupted %s\n", path);
+        rewind(fp);
+        sendFile(path, fp, s, filter, 1, 0, 1);
+        status = recvReply(s, buf);
+    }
+    return status;
+}
+
+/*
+ * Download a file, or the range of it given after its name as
+ * "<offset> [<length>]", into the working directory. The content is written
+ * as it arrives: a whole file goes to "<name>.part" and is renamed once
+ * complete, so a cut download never replaces a good copy, while a range is
+ * written in place at its offset.
+ * Returns 0 on success, -1 otherwise; exits if there was an error.
+ */
+int getFile(int s, const char *argument, char *buf)
+{
+    static char chunk[CHUNKSZ];
+
+    char name[MAX_NAME_LENGTH + 1];
+    size_t nameLength = strcspn(argument, " ");
+    if (nameLength == 0 || nameLength > MAX_NAME_LENGTH || strchr(argument, '/') != NULL)
+    {
+        printf("%s not valid!\n", argument);
+        return -1;
+    }
+    memcpy(name, argument, nameLength);
+    name[nameLength] = '\0';
+
+    char *end;
+    int ranged = argument[nameLength] != '\0';
+    uint64_t offset = strtoull(argument + nameLength, &end, 10);
+    uint64_t length = strtoull(end, &end, 10);
+
+    uint64_t fields[2] = {htobe64(offset), htobe64(length)};
+    if (sendFrame(s, OP_GET, 0, name, fields, GET_SIZE) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    struct FrameHeader header;
+    if (recvHeader(s, &header) != 0 || header.opcode != OP_REPLY || header.nameLength != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (header.status != STATUS_CONTENT)
+    {
+        if (header.payloadLength >= BUFSZ || recvAll(s, buf, header.payloadLength) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        buf[header.payloadLength] = '\0';
+        puts(buf);
+        return -1;
+    }
+
+    uint64_t total;
+    if (header.payloadLength < CONTENT_HEADER_SIZE ||
+        recvAll(s, &total, CONTENT_HEADER_SIZE) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    total = be64toh(total);
+    uint64_t remaining = header.payloadLength - CONTENT_HEADER_SIZE;
+    uint64_t received = remaining;
+
+    char partName[MAX_NAME_LENGTH + sizeof(PART_SUFFIX)];
+    snprintf(partName, sizeof(partName), "%s%s", name, PART_SUFFIX);
+    int fd = ranged ? open(name, O_WRONLY | O_CREAT, 0644)
+                    : open(partName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int failed = fd == -1 || (ranged && lseek(fd, offset, SEEK_SET) == -1);
+
+    // The content is read to the end even when it cannot be written, so the
+    // next reply is found where it belongs
+    while (remaining > 0)
+    {
+        size_t wanted = remaining < CHUNKSZ ? (size_t)remaining : CHUNKSZ;
+        if (recvAll(s, chunk, wanted) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (!failed && writeAll(fd, chunk, wanted) != 0)
+        {
+            failed = 1;
+        }
+        remaining -= wanted;
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (!failed && !ranged && rename(partName, name) != 0)
+    {
+        failed = 1;
+    }
+
+    if (failed)
+    {
+        printf("file %s not written\n", name);
+        return -1;
+    }
+    if (ranged)
+        printf("file %s received (%llu bytes at %llu of %llu)\n", name,
+               (unsigned long long)received, (unsigned long long)offset, (unsigned long long)total);
+    else
+        printf("file %s received (%llu bytes)\n", name, (unsigned long long)received);
+    return 0;
+}
+
+/*
+ * One range of a multi-stream transfer and the connection sending it.
+ */
+struct RangeStream
+{
+    const struct sockaddr_storage *storage;
+    const char *baseName;
+    int fd;
+    uint64_t id;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t total;
+    pthread_t thread;
+};
+
+/*
+ * Send one range over its own connection and wait for the server to
+ * acknowledge it. Runs in its own thread; exits if there was an error.
+ */
+void *sendRange(void *arg)
+{
+    struct RangeStream *range = arg;
+    char buf[BUFSZ];
+
+    int s = socket(range->storage->ss_family, SOCK_STREAM, 0);
+    if (s == -1 || connect(s, (const struct sockaddr *)range->storage, sizeof(*range->storage)) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t fields[3] = {htobe64(range->id), htobe64(range->offset), htobe64(range->total)};
+    if (sendFrameHeader(s, OP_RANGE, 0, range->baseName, RANGE_HEADER_SIZE + range->length) != 0 ||
+        sendAll(s, fields, RANGE_HEADER_SIZE) != 0 ||
+        sendFileZeroCopy(s, range->fd, range->offset, range->length) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (recvReply(s, buf) != STATUS_RECEIVED)
+    {
+        printf("range at %llu of %s not written\n", (unsigned long long)range->offset, range->baseName);
+        exit(EXIT_FAILURE);
+    }
+
+    sendFrame(s, OP_EXIT, 0, NULL, NULL, 0);
+    close(s);
+    return NULL;
+}
+
+/*
+ * Send a large file as ranges over parallel connections, so the transfer is
+ * not limited by the window of a single TCP connection, then commit it over
+ * the main connection once every range was acknowledged. The reply to the
+ * commit is left to the caller.
+ * Parameters:
+ *   - fileNameExtracted: name of the file, sent without its directory
+ *   - fp: file pointer of the file to be sent
+ *   - s: the main connection
+ *   - storage: the address of the server
+ *   - streams: the number of parallel connections
+ * Returns:
+ *   - 0 if the file was sent and committed
+ *   - -1 if it is too small to be split
+ *   - exits if there was an error
+ */
+int sendParallel(const char *fileNameExtracted, FILE *fp, int s,
+                 const struct sockaddr_storage *storage, int streams)
+{
+    static struct RangeStream ranges[MAX_STREAMS];
+
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    uint64_t total = st.st_size;
+    if (total < PARALLEL_MIN)
+    {
+        return -1;
+    }
+
+    const char *baseName = strrchr(fileNameExtracted, '/');
+    baseName = baseName != NULL ? baseName + 1 : fileNameExtracted;
+
+    uint64_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Split on CHUNKSZ boundaries so ranges do not share file system blocks
+    uint64_t rangeLength = (total / streams + CHUNKSZ - 1) / CHUNKSZ * CHUNKSZ;
+    int count = 0;
+    for (uint64_t offset = 0; offset < total; offset += rangeLength, count++)
+    {
+        struct RangeStream *range = &ranges[count];
+        range->storage = storage;
+        range->baseName = baseName;
+        range->fd = fileno(fp);
+        range->id = id;
+        range->offset = offset;
+        range->length = total - offset < rangeLength ? total - offset : rangeLength;
+        range->total = total;
+        if (pthread_create(&range->thread, NULL, sendRange, range) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(ranges[i].thread, NULL);
+    }
+
+    uint64_t fields[2] = {htobe64(id), htobe64(total)};
+    if (sendFrame(s, OP_COMMIT, 0, baseName, fields, COMMIT_SIZE) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+/*
+ * Get the word describing a reply status.
+ */
+const char *statusVerb(uint32_t status)
+{
+    switch (status)
+    {
+    case STATUS_RECEIVED:
+        return "received";
+    case STATUS_OVERWRITTEN:
+        return "overwritten";
+    case STATUS_INVALID_NAME:
+        return "not valid";
+    case STATUS_CORRUPT:
+        return "corrupted";
+    default:
+        return "not written";
+    }
+}
+
+/*
+ * Append a copy of path to the list if it is a regular file of a valid type.
+ * Parameters:
+ *   - paths: growable array of paths
+ *   - count: number of paths in the array
+ */
+void addBatchPath(char ***paths, size_t *count, const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || !fileIsValidType(path))
+    {
+        return;
+    }
+
+    char **grown = realloc(*paths, (*count + 1) * sizeof(char *));
+    if (grown == NULL || (grown[*count] = strdup(path)) == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    *paths = grown;
+    (*count)++;
+}
+
+/*
+ * Collect the files of a "send dir <path>" or "send glob <pattern>" command.
+ * Returns the number of paths stored in `paths`.
+ */
+size_t collectBatchPaths(int option, const char *argument, char ***paths)
+{
+    size_t count = 0;
+    *paths = NULL;
+
+    if (option == SEND_DIR)
+    {
+        DIR *dir = opendir(argument);
+        if (dir == NULL)
+        {
+            return 0;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", argument, entry->d_name);
+            addBatchPath(paths, &count, path);
+        }
+        closedir(dir);
+        return count;
+    }
+
+    glob_t matches;
+    if (glob(argument, 0, NULL, &matches) == 0)
+    {
+        for (size_t i = 0; i < matches.gl_pathc; i++)
+        {
+            addBatchPath(paths, &count, matches.gl_pathv[i]);
+        }
+    }
+    globfree(&matches);
+    return count;
+}
+
+/*
+ * Send the pending bundle as one OP_BUNDLE frame, gathering the header,
+ * the index and the file contents with a single vectored write.
+ */
+void flushBundle(struct Batch *batch, int s)
+{
+    if (batch->memberCount == 0)
+    {
+        return;
+    }
+
+    uint32_t count = htonl(batch->memberCount);
+    struct FrameHeader header;
+    unsigned char raw[FRAME_HEADER_SIZE];
+    initHeader(&header, OP_BUNDLE, 0, sizeof(count) + batch->indexLength + batch->dataLength);
+    encodeHeader(&header, raw);
+
+    struct iovec iov[4] = {
+        {raw, FRAME_HEADER_SIZE},
+        {&count, sizeof(count)},
+        {batch->index, batch->indexLength},
+        {batch->data, batch->dataLength}};
+    if (sendAllv(s, iov, 4) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (uint32_t i = 0; i < batch->memberCount; i++)
+    {
+        batch->order[batch->sent++] = batch->members[i];
+    }
+    batch->memberCount = 0;
+    batch->indexLength = 0;
+    batch->dataLength = 0;
+}
+
+/*
+ * Append a small file to the pending bundle, sending the bundle first when
+ * the file does not fit in it.
+ * Parameters:
+ *   - batch: the batch being sent
+ *   - path: the file
+ *   - position: index of the file in the batch
+ *   - fp: file pointer of the file
+ *   - size: size of the file
+ */
+void addToBundle(struct Batch *batch, const char *path, size_t position, FILE *fp,
+                 size_t size, int s, int filter)
+{
+    const char *baseName = strrchr(path, '/');
+    baseName = baseName != NULL ? baseName + 1 : path;
+    size_t nameLength = strlen(baseName);
+    size_t entrySize = BUNDLE_ENTRY_SIZE + nameLength;
+
+    if (sizeof(uint32_t) + batch->indexLength + entrySize + batch->dataLength + size > BUNDLE_MAX)
+    {
+        flushBundle(batch, s);
+    }
+
+    size_t length = fread(batch->data + batch->dataLength, sizeof(char), size, fp);
+    if (filter)
+    {
+        length = removeSpecialCharacters(batch->data + batch->dataLength, length);
+    }
+
+    uint16_t entryName = htons(nameLength);
+    uint32_t entryOffset = htonl(batch->dataLength);
+    uint32_t entryLength = htonl(length);
+    char *entry = batch->index + batch->indexLength;
+    memcpy(entry, &entryName, 2);
+    memcpy(entry + 2, &entryOffset, 4);
+    memcpy(entry + 6, &entryLength, 4);
+    memcpy(entry + BUNDLE_ENTRY_SIZE, baseName, nameLength);
+
+    batch->indexLength += entrySize;
+    batch->dataLength += length;
+    batch->members[batch->memberCount++] = position;
+}
+
+/*
+ * Look up the hash of every file of the batch, LOOKUP_WINDOW files at a time.
+ * Files the server created from its content store get their status;
+ * the others are marked STATUS_MISSING and still have to be sent.
+ * Parameters:
+ *   - paths: the files of the batch
+ *   - count: the number of files
+ *   - statuses: the status of each file
+ */
+void lookupBatch(char **paths, size_t count, int s, int filter, uint32_t *statuses)
+{
+    char buf[BUFSZ];
+    for (size_t first = 0; first < count; first += LOOKUP_WINDOW)
+    {
+        size_t last = first + LOOKUP_WINDOW < count ? first + LOOKUP_WINDOW : count;
+        for (size_t i = first; i < last; i++)
+        {
+            FILE *fp = fopen(paths[i], "rb");
+            if (fp == NULL)
+            {
+                exit(EXIT_FAILURE);
+            }
+            sendLookup(paths[i], fp, s, filter);
+            fclose(fp);
+        }
+        for (size_t i = first; i < last; i++)
+        {
+            statuses[i] = recvReply(s, buf);
+        }
+    }
+}
+
+/*
+ * Send every file of the batch back to back, without waiting for the server
+ * between files, then print the status of each one from the single
+ * OP_BATCH_REPLY that acknowledges the whole batch. With bundling, small
+ * files are packed together and only larger ones get their own frame. With
+ * deduplication, files whose content the server already stores are not sent.
+ * Parameters:
+ *   - option: SEND_DIR or SEND_GLOB
+ *   - argument: the directory or the pattern
+ *   - s: socket descriptor
+ *   - filter: whether special characters are removed from the content
+ *   - bundle: whether small files are bundled
+ *   - dedup: whether the server is asked for each content first
+ *   - level: compression level of the files not bundled, 0 for none
+ *   - checked: whether the files not bundled are sent as checked chunks,
+ *     those found corrupted being resent on their own after the batch
+ */
+void sendBatch(int option, const char *argument, int s, int filter, int bundle, int dedup,
+               int level, int checked)
+{
+    static struct Batch batch;
+    char buf[BUFSZ];
+    char **paths;
+    size_t count = collectBatchPaths(option, argument, &paths);
+    if (count == 0)
+    {
+        printf("no valid files in %s\n", argument);
+        return;
+    }
+
+    batch.order = malloc(count * sizeof(size_t));
+    batch.members = malloc(count * sizeof(size_t));
+    batch.sent = 0;
+    uint32_t *statuses = malloc(count * sizeof(uint32_t));
+    if (batch.order == NULL || batch.members == NULL || statuses == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        statuses[i] = STATUS_MISSING;
+    }
+    if (dedup)
+    {
+        lookupBatch(paths, count, s, filter, statuses);
+    }
+
+    if (sendFrame(s, OP_BATCH_BEGIN, 0, NULL, NULL, 0) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (statuses[i] != STATUS_MISSING)
+        {
+            continue;
+        }
+
+        FILE *fp = fopen(paths[i], "rb");
+        struct stat st;
+        if (fp == NULL || fstat(fileno(fp), &st) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        if (bundle && st.st_size <= BUNDLE_FILE_MAX)
+        {
+            addToBundle(&batch, paths[i], i, fp, st.st_size, s, filter);
+        }
+        else
+        {
+            sendFile(paths[i], fp, s, filter, 0, level, checked);
+            batch.order[batch.sent++] = i;
+        }
+        fclose(fp);
+    }
+    flushBundle(&batch, s);
+    if (sendFrame(s, OP_BATCH_END, 0, NULL, NULL, 0) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    struct FrameHeader header;
+    if (recvHeader(s, &header) != 0 || header.opcode != OP_BATCH_REPLY ||
+        header.payloadLength != batch.sent * sizeof(uint32_t))
+    {
+        exit(EXIT_FAILURE);
+    }
+    uint32_t *replies = malloc(batch.sent * sizeof(uint32_t) + 1);
+    if (replies == NULL || recvAll(s, replies, batch.sent * sizeof(uint32_t)) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < batch.sent; i++)
+    {
+        statuses[batch.order[i]] = ntohl(replies[i]);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (statuses[i] == STATUS_CORRUPT)
+        {
+            FILE *fp = fopen(paths[i], "rb");
+            if (fp == NULL)
+            {
+                exit(EXIT_FAILURE);
+            }
+            statuses[i] = resendCorrupted(paths[i], fp, s, filter, statuses[i], buf);
+            fclose(fp);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *baseName = strrchr(paths[i], '/');
+        baseName = baseName != NULL ? baseName + 1 : paths[i];
+        printf("file %s %s\n", baseName, statusVerb(statuses[i]));
+        free(paths[i]);
+    }
+    free(replies);
+    free(statuses);
+    free(paths);
+    free(batch.order);
+    free(batch.members);
+}
+
 /*
  * Get the client option based on the user's input.
  * Parameters:
@@ -122,6 +1232,15 @@ enum Options getClientOptions(const char *option)
     if (strcmp(temp, "send file") == 0)
         return SEND;
 
+    if (strncmp(temp, "send dir ", SIZESENDDIR) == 0)
+        return SEND_DIR;
+
+    if (strncmp(temp, "send glob ", SIZESENDGLOB) == 0)
+        return SEND_GLOB;
+
+    if (strncmp(temp, "get file ", SIZEGETFILE) == 0)
+        return GET;
+
     if (strncmp(temp, "select file ", SIZEOPTION) == 0)
     {
 
@@ -141,15 +1260,48 @@ enum Options getClientOptions(const char *option)
 
 int main(int argc, char **argv)
 {
+    int filter = 0;
+    int bundle = 0;
+    int resume = 0;
+    int dedup = 0;
+    int delta = 0;
+    int streams = 1;
+    int level = 0;
+    int checked = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "fbrdDp:zZc")) != -1)
+    {
+        if (opt == 'f')
+            filter = 1;
+        else if (opt == 'b')
+            bundle = 1;
+        else if (opt == 'r')
+            resume = 1;
+        else if (opt == 'd')
+            dedup = 1;
+        else if (opt == 'D')
+            delta = 1;
+        else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= MAX_STREAMS)
+            streams = atoi(optarg);
+        else if (opt == 'z')
+            level = COMPRESS_FAST;
+        else if (opt == 'Z')
+            level = COMPRESS_HIGH;
+        else if (opt == 'c')
+            checked = 1;
+        else
+            clientUsage(argc, argv);
+    }
+
     // Check if the required command-line arguments are provided
-    if (argc < 3)
+    if (argc - optind < 2)
     {
         clientUsage(argc, argv);
     }
 
     // Parse the server IP address and port number
     struct sockaddr_storage storage;
-    if (0 != addrparse(argv[1], argv[2], &storage))
+    if (0 != addrparse(argv[optind], argv[optind + 1], &storage))
     {
         clientUsage(argc, argv);
         exit(EXIT_FAILURE);
@@ -173,16 +1325,31 @@ int main(int argc, char **argv)
     char addrstr[BUFSZ];
     addrtostr(addr, addrstr, BUFSZ);
 
+    uint32_t wanted = (level ? CAP_COMPRESS : 0) | (checked ? CAP_CHECKSUM : 0);
+    uint32_t capabilities = wanted ? negotiateCapabilities(s, wanted) : 0;
+    if (level && !(capabilities & CAP_COMPRESS))
+    {
+        puts("server does not support compression");
+        level = 0;
+    }
+    if (checked && !(capabilities & CAP_CHECKSUM))
+    {
+        puts("server does not support checksums");
+        checked = 0;
+    }
+    // Ranges are written in place at their offset, so they carry raw content
+    if (streams > 1 && !filter && (level || checked))
+    {
+        printf("files of %d MiB or more are sent as ranges, neither compressed nor checksummed\n",
+               PARALLEL_MIN / (1024 * 1024));
+    }
+
     char buf[BUFSZ];
     memset(buf, 0, BUFSZ);
 
-    size_t count;
     int fileSelected = 0;
-    int shouldSendFile = 0;
-    int sendEnd = 0;
     char fileNameExtracted[BUFSZ];
     FILE *fp;
-    int fileNameCount = 0;
 
     while (1)
     {
@@ -203,21 +1370,55 @@ int main(int argc, char **argv)
             {
                 // Open the file to be sent
                 fp = fopen(fileNameExtracted, "rb");
+                if (fp == NULL)
+                {
+                    printf("%s do not exist\n", fileNameExtracted);
+                    break;
+                }
 
-                // Send the file
-                sendEnd = sendFile(buf, fileNameCount, fileNameExtracted, fp, s);
-
-                count = recv(s, buf, BUFSZ, 0);
-                if (count == -1)
+                // Let the server create the file from its store if it can
+                if (dedup)
                 {
-                    exit(EXIT_FAILURE);
+                    sendLookup(fileNameExtracted, fp, s, filter);
+                    if (recvReply(s, buf) != STATUS_MISSING)
+                    {
+                        fclose(fp);
+                        puts(buf);
+                        break;
+                    }
                 }
 
-                puts(buf);
+                // Send only the changes if the server has a copy, else split
+                // large unfiltered files across streams, else send it whole
+                if ((!delta || sendDelta(fileNameExtracted, fp, s, filter) != 0) &&
+                    (streams == 1 || filter ||
+                     sendParallel(fileNameExtracted, fp, s, &storage, streams) != 0))
+                {
+                    sendFile(fileNameExtracted, fp, s, filter, resume, level, checked);
+                }
 
+                uint32_t status = recvReply(s, buf);
+                if (status == STATUS_CORRUPT)
+                {
+                    puts(buf);
+                    status = resendCorrupted(fileNameExtracted, fp, s, filter, status, buf);
+                }
                 fclose(fp);
+                puts(buf);
             }
             break;
+        case SEND_DIR:
+        case SEND_GLOB:
+            // Send every matching file in one pipelined batch
+            buf[strcspn(buf, "\n")] = '\0';
+            sendBatch(option, buf + (option == SEND_DIR ? SIZESENDDIR : SIZESENDGLOB), s, filter,
+                      bundle, dedup, level, checked);
+            break;
+        case GET:
+            // Download a file, or a range of it, from the server
+            buf[strcspn(buf, "\n")] = '\0';
+            getFile(s, buf + SIZEGETFILE, buf);
+            break;
         case SELECT_NOT_EXISTS:
             // Extract the file name and notify that it doesn't exist
             extractFileName(buf, fileNameExtracted);
@@ -233,13 +1434,12 @@ int main(int argc, char **argv)
         case SELECT_VALID:
             // Extract the file name and notify that it is selected
             extractFileName(buf, fileNameExtracted);
-            fileNameCount = strlen(fileNameExtracted);
             printf("%s selected\n", fileNameExtracted);
             fileSelected = 1;
             break;
         case EXIT:
             // Send the exit command to the server and close the socket
-            count = send(s, buf, strlen(buf), 0);
+            sendFrame(s, OP_EXIT, 0, NULL, NULL, 0);
             close(s);
             exit(EXIT_SUCCESS);
             break;
@@ -6,56 +6,59 @@
 #include <string.h>
 #include <arpa/inet.h>
 
-static const char *extensions[] = {"java", "txt", "tex", "cpp", "py", "c"};
-static const int num_extensions = sizeof(extensions) / sizeof(const char *);
 #define SIZEOPTION 12
-#define MAXEXTENSIONLENGTH 4
 
 /*
- * Extracts the file name and the extension of the file. 
- * - string is the input
- * - filename is the result
+ * Map an extension, of known length and not NUL terminated, to its file
+ * type. The extension is packed into one integer, letters folded to
+ * lowercase, and matched by a switch over the packed FILE_TYPES_FILE
+ * entries that the compiler turns into a few compares.
+ * Returns FILE_TYPE_INVALID if the type is not supported.
  */
-void extractFileNameExtension(const char *string, char *filename)
+enum FileType fileTypeOf(const char *extension, size_t length)
 {
-    size_t longest_length = MAXEXTENSIONLENGTH;
-
-    const char *dot = strchr(string, '.');
-    if (dot != NULL)
+    if (length == 0 || length > EXTENSION_MAX)
     {
-        size_t filename_length = dot - string;
-        strncpy(filename, string, filename_length);
-        filename[filename_length] = '\0';
-
-        const char *extension = dot + 1;
+        return FILE_TYPE_INVALID;
+    }
 
-        for (size_t i = 0; i < longest_length; i++)
+    uint64_t key = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = extension[i];
+        if (c == '\0')
+        {
+            return FILE_TYPE_INVALID;
+        }
+        if ((unsigned)(c - 'A') < 26)
         {
-            char current_char = extension[i];
-            if (current_char == '\0')
-            {
-                break;
-            }
-
-            // Check if the current extension matches any of the valid extensions
-            for (int j = 0; j < num_extensions; j++)
-            {
-                const char *valid_extension = extensions[j];
-                if (strncmp(extension + i, valid_extension, strlen(valid_extension)) == 0)
-                {
-                    strcat(filename, ".");
-                    strcat(filename, extensions[j]);
-                    return;
-                }
-            }
+            c |= 0x20;
         }
+        key |= (uint64_t)c << (56 - 8 * i);
     }
-    else
+
+    switch (key)
     {
-        strcpy(filename, string);
+#define FILE_TYPE(type, ...)           \
+    case PACK_EXTENSION(__VA_ARGS__): \
+        return type;
+#include FILE_TYPES_FILE
+#undef FILE_TYPE
+    default:
+        return FILE_TYPE_INVALID;
     }
 }
 
+/*
+ * Check if an extension, of known length and not NUL terminated, is one of
+ * the supported file types.
+ * Returns 1 if valid, 0 otherwise.
+ */
+int extensionIsValid(const char *extension, size_t length)
+{
+    return fileTypeOf(extension, length) != FILE_TYPE_INVALID;
+}
+
 /*
  * Check if the file name has a valid extension.
  * Returns 1 if valid, 0 otherwise.
@@ -70,15 +73,7 @@ int fileIsValidType(const char *filename)
 
     extension++;
 
-    for (int i = 0; i < num_extensions; i++)
-    {
-        if (strcasecmp(extension, extensions[i]) == 0)
-        {
-            return 1;
-        }
-    }
-
-    return 0;
+    return extensionIsValid(extension, strlen(extension));
 }
 
 /*
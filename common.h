@@ -2,19 +2,32 @@
 #define COMMON_H
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <arpa/inet.h>
 
+// List of supported file types, chosen at build time
+#ifndef FILE_TYPES_FILE
+#define FILE_TYPES_FILE "filetypes.def"
+#endif
+
+#define EXTENSION_MAX 8
+
+// An extension packed into an integer, first character in the top byte
+#define PACK_EXTENSION(...) PACK_EXTENSION8(__VA_ARGS__, 0, 0, 0, 0, 0, 0, 0, 0)
+#define PACK_EXTENSION8(a, b, c, d, e, f, g, h, ...)                               \
+    ((uint64_t)(a) << 56 | (uint64_t)(b) << 48 | (uint64_t)(c) << 40 |            \
+     (uint64_t)(d) << 32 | (uint64_t)(e) << 24 | (uint64_t)(f) << 16 |            \
+     (uint64_t)(g) << 8 | (uint64_t)(h))
+
 // Supported file types
 enum FileType
 {
-    TXT,
-    C,
-    CPP,
-    PY,
-    TEX,
-    JAVA
+#define FILE_TYPE(type, ...) type,
+#include FILE_TYPES_FILE
+#undef FILE_TYPE
+    FILE_TYPE_INVALID = -1
 };
 
 // Supported options
@@ -26,6 +39,9 @@ enum Options
     SELECT_INVALID = 4,
     EXIT = 5,
     CONNECTION_CLOSED = 6,
+    SEND_DIR = 7,
+    SEND_GLOB = 8,
+    GET = 9,
     INVALID_OPERATION = -1
 };
 
@@ -37,16 +53,14 @@ void addrtostr(const struct sockaddr *addr, char *str, size_t strsize);
 int server_sockaddr_init(const char *proto, const char *portstr,
                          struct sockaddr_storage *storage);
 
+enum FileType fileTypeOf(const char *extension, size_t length);
+
+int extensionIsValid(const char *extension, size_t length);
+
 int fileIsValidType(const char *filename);
 
 int fileExists(const char *filename);
 
 void extractFileName(const char *option, char *fileName);
 
-int endsWithEnd(const char *str);
-
-void removeEnd(char *str);
-
-void extractFileNameExtension(const char *string, char *filename);
-
 #endif
\ No newline at end of file
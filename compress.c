@@ -0,0 +1,353 @@
+#include "compress.h"
+#include "protocol.h"
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define FAST_HASH_BITS 14
+#define HIGH_HASH_BITS 16
+#define HIGH_DEPTH 64
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash4(uint32_t value, int bits)
+{
+    return (value * 2654435761u) >> (32 - bits);
+}
+
+/*
+ * Write the bytes extending a length that did not fit in its nibble.
+ */
+static unsigned char *writeLength(unsigned char *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+/*
+ * Write one sequence: literals followed by a match, or by nothing when
+ * matchLength is 0.
+ * Returns the end of the output, NULL if it does not fit before `end`.
+ */
+static unsigned char *writeSequence(unsigned char *op, const unsigned char *end,
+                                    const unsigned char *literals, size_t literalLength,
+                                    size_t offset, size_t matchLength)
+{
+    size_t needed = 1 + literalLength + literalLength / 255 + 1 + 2 + matchLength / 255 + 1;
+    if ((size_t)(end - op) < needed)
+    {
+        return NULL;
+    }
+
+    unsigned char *token = op++;
+    *token = (literalLength < 15 ? literalLength : 15) << 4;
+    if (literalLength >= 15)
+    {
+        op = writeLength(op, literalLength - 15);
+    }
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (matchLength == 0)
+    {
+        return op;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    matchLength -= MIN_MATCH;
+    *token |= matchLength < 15 ? matchLength : 15;
+    if (matchLength >= 15)
+    {
+        op = writeLength(op, matchLength - 15);
+    }
+    return op;
+}
+
+/*
+ * Compress one chunk of at most CHUNKSZ bytes. The fast level probes one
+ * earlier position per hash and skips ahead faster the longer nothing
+ * matches; the high level walks hash chains for the longest match.
+ * Returns the compressed length, or 0 if it would not fit in `capacity`.
+ */
+size_t compressChunk(const unsigned char *in, size_t length, unsigned char *out, size_t capacity,
+                     int level)
+{
+    // Positions are stored plus one, so 0 means empty
+    static uint32_t heads[1 << HIGH_HASH_BITS];
+    static uint32_t chain[CHUNKSZ];
+
+    if (length > CHUNKSZ)
+    {
+        return 0;
+    }
+
+    int high = level == COMPRESS_HIGH;
+    int bits = high ? HIGH_HASH_BITS : FAST_HASH_BITS;
+    memset(heads, 0, ((size_t)1 << bits) * sizeof(uint32_t));
+
+    unsigned char *op = out;
+    const unsigned char *end = out + capacity;
+    size_t anchor = 0, position = 0, misses = 0;
+
+    while (position + MIN_MATCH <= length)
+    {
+        uint32_t h = hash4(read32(in + position), bits);
+        uint32_t candidate = heads[h];
+        size_t best = 0, bestOffset = 0;
+
+        heads[h] = position + 1;
+        if (high)
+        {
+            chain[position] = candidate;
+        }
+
+        for (int depth = high ? HIGH_DEPTH : 1; candidate != 0 && depth > 0; depth--)
+        {
+            size_t earlier = candidate - 1;
+            if (position - earlier > MAX_OFFSET)
+            {
+                break;
+            }
+            if (read32(in + earlier) == read32(in + position))
+            {
+                size_t matched = MIN_MATCH;
+                while (position + matched < length && in[earlier + matched] == in[position + matched])
+                {
+                    matched++;
+                }
+                if (matched > best)
+                {
+                    best = matched;
+                    bestOffset = position - earlier;
+                }
+            }
+            candidate = high ? chain[earlier] : 0;
+        }
+
+        if (best < MIN_MATCH)
+        {
+            position += 1 + (high ? 0 : misses++ >> 5);
+            continue;
+        }
+
+        op = writeSequence(op, end, in + anchor, position - anchor, bestOffset, best);
+        if (op == NULL)
+        {
+            return 0;
+        }
+        if (high)
+        {
+            // Index the positions inside the match for later searches
+            for (size_t i = position + 1; i < position + best && i + MIN_MATCH <= length; i++)
+            {
+                uint32_t inner = hash4(read32(in + i), bits);
+                chain[i] = heads[inner];
+                heads[inner] = i + 1;
+            }
+        }
+        position += best;
+        anchor = position;
+        misses = 0;
+    }
+
+    op = writeSequence(op, end, in + anchor, length - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - out);
+}
+
+/*
+ * Read the bytes extending a length that did not fit in its nibble.
+ * Returns -1 if the input ends first.
+ */
+static long readLength(const unsigned char *in, size_t length, size_t *ip)
+{
+    long total = 0;
+    unsigned char byte;
+    do
+    {
+        if (*ip >= length)
+        {
+            return -1;
+        }
+        byte = in[(*ip)++];
+        total += byte;
+    } while (byte == 255);
+    return total;
+}
+
+/*
+ * Decompress one chunk, checking every length and offset against the input
+ * and the output buffer.
+ * Returns the decompressed length, -1 if the input is invalid.
+ */
+long decompressChunk(const unsigned char *in, size_t length, unsigned char *out, size_t capacity)
+{
+    size_t ip = 0, op = 0;
+    while (ip < length)
+    {
+        unsigned char token = in[ip++];
+
+        long literalLength = token >> 4;
+        if (literalLength == 15)
+        {
+            long extra = readLength(in, length, &ip);
+            if (extra < 0)
+                return -1;
+            literalLength += extra;
+        }
+        if ((size_t)literalLength > length - ip || (size_t)literalLength > capacity - op)
+        {
+            return -1;
+        }
+        memcpy(out + op, in + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        // The last sequence has no match
+        if (ip == length)
+        {
+            break;
+        }
+
+        if (length - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        long matchLength = token & 15;
+        if (matchLength == 15)
+        {
+            long extra = readLength(in, length, &ip);
+            if (extra < 0)
+                return -1;
+            matchLength += extra;
+        }
+        matchLength += MIN_MATCH;
+        if (offset == 0 || offset > op || (size_t)matchLength > capacity - op)
+        {
+            return -1;
+        }
+
+        // Byte by byte, since the match may overlap what it produces
+        for (long i = 0; i < matchLength; i++)
+        {
+            out[op + i] = out[op - offset + i];
+        }
+        op += matchLength;
+    }
+    return op;
+}
+
+/*
+ * Start decompressing content into a file, through two buffers of CHUNKSZ
+ * bytes owned by the caller.
+ */
+void chunkDecoderInit(struct ChunkDecoder *decoder, int out, unsigned char *in,
+                      unsigned char *raw)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->out = out;
+    decoder->in = in;
+    decoder->raw = raw;
+}
+
+/*
+ * Consume the next piece of compressed content, up to the end of the
+ * content. Raw chunks are written straight from the input, compressed ones
+ * once they are complete.
+ * Returns the number of bytes consumed, -1 if the chunk framing is invalid
+ * and the end of the content cannot be found.
+ */
+long chunkDecoderFeed(struct ChunkDecoder *decoder, const char *data, size_t length)
+{
+    size_t consumed = 0;
+    while (consumed < length && !decoder->ended)
+    {
+        size_t taken;
+        if (decoder->headerLength < CHUNK_HEADER_SIZE)
+        {
+            taken = CHUNK_HEADER_SIZE - decoder->headerLength;
+            taken = taken < length - consumed ? taken : length - consumed;
+            memcpy(decoder->header + decoder->headerLength, data + consumed, taken);
+            decoder->headerLength += taken;
+            consumed += taken;
+            if (decoder->headerLength < CHUNK_HEADER_SIZE)
+            {
+                break;
+            }
+
+            uint32_t word;
+            memcpy(&word, decoder->header, sizeof(word));
+            word = be32toh(word);
+            decoder->compressed = (word & CHUNK_COMPRESSED) != 0;
+            decoder->stored = word & ~CHUNK_COMPRESSED;
+            decoder->inLength = 0;
+            if (word == CHUNK_END)
+            {
+                decoder->headerLength = 0;
+                decoder->ended = 1;
+            }
+            else if (decoder->stored == 0 || decoder->stored > CHUNKSZ)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        taken = decoder->stored - decoder->inLength;
+        taken = taken < length - consumed ? taken : length - consumed;
+        if (!decoder->failed && !decoder->compressed)
+        {
+            if (writeAll(decoder->out, data + consumed, taken) != 0)
+            {
+                decoder->failed = 1;
+            }
+            decoder->written += taken;
+        }
+        else if (!decoder->failed)
+        {
+            memcpy(decoder->in + decoder->inLength, data + consumed, taken);
+        }
+        decoder->inLength += taken;
+        consumed += taken;
+
+        if (decoder->inLength < decoder->stored)
+        {
+            break;
+        }
+        decoder->headerLength = 0;
+        if (decoder->compressed && !decoder->failed)
+        {
+            long raw = decompressChunk(decoder->in, decoder->stored, decoder->raw, CHUNKSZ);
+            if (raw < 0 || writeAll(decoder->out, (const char *)decoder->raw, raw) != 0)
+            {
+                decoder->failed = 1;
+            }
+            else
+            {
+                decoder->written += raw;
+            }
+        }
+    }
+    return consumed;
+}
+
+/*
+ * Check that the end of the content was reached.
+ */
+int chunkDecoderDone(const struct ChunkDecoder *decoder)
+{
+    return decoder->ended;
+}
@@ -0,0 +1,62 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Built-in LZ77 codec in the LZ4 block format: sequences of a token
+ * (literal count and match length nibbles), extra length bytes, literals,
+ * and a 16-bit little-endian match offset. The last sequence has literals
+ * only.
+ *
+ * Compressed content is a series of chunks of at most CHUNKSZ raw bytes,
+ * each preceded by a 32-bit big-endian word: the stored length, with
+ * CHUNK_COMPRESSED set if the chunk is compressed and not stored raw. A
+ * zero word (CHUNK_END) ends the content, so it can be sent as it is
+ * compressed without knowing its length up front.
+ */
+#define CHUNK_COMPRESSED 0x80000000u
+#define CHUNK_END 0u
+#define CHUNK_HEADER_SIZE 4
+
+enum CompressLevel
+{
+    COMPRESS_FAST = 1,
+    COMPRESS_HIGH = 2
+};
+
+/*
+ * Server side state decompressing content that arrives in arbitrary pieces
+ * and writing it to a file. Once a chunk fails to decompress or be written,
+ * the rest of the content is only parsed to find its end.
+ */
+struct ChunkDecoder
+{
+    int out;
+    unsigned char header[CHUNK_HEADER_SIZE];
+    size_t headerLength;
+    uint32_t stored;
+    int compressed;
+    unsigned char *in;
+    size_t inLength;
+    unsigned char *raw;
+    uint64_t written;
+    int failed;
+    int ended;
+};
+
+size_t compressChunk(const unsigned char *in, size_t length, unsigned char *out, size_t capacity,
+                     int level);
+
+long decompressChunk(const unsigned char *in, size_t length, unsigned char *out, size_t capacity);
+
+void chunkDecoderInit(struct ChunkDecoder *decoder, int out, unsigned char *in,
+                      unsigned char *raw);
+
+long chunkDecoderFeed(struct ChunkDecoder *decoder, const char *data, size_t length);
+
+int chunkDecoderDone(const struct ChunkDecoder *decoder);
+
+#endif
@@ -0,0 +1,2341 @@
+#define _GNU_SOURCE
+
+#include "connection.h"
+#include "store.h"
+#include "common.h"
+#include "crc32c.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+
+/*
+ * Prepare the slabs of one worker: connection contexts, reply buffers,
+ * CHUNKSZ buffers for held input and decompression, and bundles.
+ */
+void connectionPoolInit(struct ConnectionPool *pool)
+{
+    slabInit(&pool->contexts, sizeof(struct Connection), 64);
+    slabInit(&pool->outputs, OUT_BUFSZ, 64);
+    slabInit(&pool->chunks, CHUNKSZ, 16);
+    slabInit(&pool->bundles, BUNDLE_MAX + 1, 1);
+}
+
+/*
+ * Take the state of a freshly accepted client from the pool of its worker,
+ * accounted in `stats`. Only the fields before the scratch buffers are
+ * cleared.
+ * Returns NULL if there is no memory left.
+ */
+struct Connection *connectionCreate(struct ConnectionPool *pool, int socket,
+                                    const struct sockaddr *addr, struct WorkerStats *stats)
+{
+    struct Connection *conn = slabAlloc(&pool->contexts);
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+    memset(conn, 0, offsetof(struct Connection, headerBytes));
+
+    conn->socket = socket;
+    conn->state = STATE_HEADER;
+    conn->file = -1;
+    conn->sendFile = -1;
+    conn->delta.basis = -1;
+    conn->stats = stats;
+    conn->pool = pool;
+    conn->resumeName[0] = '\0';
+    addrtostr(addr, conn->address, ADDRSTRSZ);
+    stats->connections++;
+    stats->openConnections++;
+    return conn;
+}
+
+/*
+ * Close the file or release the cached mapping of a download.
+ */
+static void releaseContent(struct Connection *conn)
+{
+    if (conn->sendFile != -1)
+    {
+        close(conn->sendFile);
+        conn->sendFile = -1;
+    }
+    if (conn->sendCached != NULL)
+    {
+        fileCacheRelease(conn->cache, conn->sendCached);
+        conn->sendCached = NULL;
+    }
+}
+
+/*
+ * Close the socket and the destination file and release the state.
+ * A transfer cut in the middle is reported as an error.
+ */
+void connectionDestroy(struct Connection *conn)
+{
+    // Keep every byte received for a resume, and wait until the disk
+    // threads are done with the file
+    if (conn->writeBehind)
+    {
+        if (conn->diskBuffer != NULL)
+        {
+            diskWrite(conn->disk, conn->diskBuffer);
+        }
+        diskCancel(conn->disk, &conn->diskFile);
+    }
+    if (conn->task != TASK_NONE)
+    {
+        diskCancel(conn->disk, &conn->diskFile);
+        free(conn->taskData);
+    }
+    if (conn->state == STATE_DELTA)
+    {
+        logPrintf("error receiving file %s\n", conn->fileName);
+        unlink(conn->partName);
+    }
+    if (conn->state == STATE_NAME || conn->state == STATE_PAYLOAD ||
+        conn->state == STATE_COMPRESSED || conn->state == STATE_WRITING)
+    {
+        conn->fileName[conn->nameLength] = '\0';
+        logPrintf("error receiving file %s\n", conn->fileName);
+
+        // Make the bytes kept in the .part file durable for a later resume,
+        // only the verified chunks of a checked transfer. A private file
+        // cannot be resumed.
+        if (conn->file != -1 && conn->partial && !conn->resumable)
+        {
+            unlink(conn->partName);
+        }
+        else if (conn->file != -1 && conn->partial)
+        {
+            if (conn->checked && ftruncate(conn->file, conn->checkOffset) != 0)
+            {
+                unlink(conn->partName);
+            }
+            fdatasync(conn->file);
+        }
+    }
+    if (conn->state == STATE_BUNDLE)
+    {
+        logPrintf("error receiving bundle from %s\n", conn->address);
+    }
+    if (conn->state == STATE_SENDING)
+    {
+        logPrintf("error sending file %s\n", conn->fileName);
+    }
+    releaseContent(conn);
+    if (conn->file != -1)
+    {
+        close(conn->file);
+    }
+    if (conn->delta.basis != -1)
+    {
+        close(conn->delta.basis);
+    }
+    close(conn->socket);
+
+    conn->stats->openConnections--;
+
+    struct ConnectionPool *pool = conn->pool;
+    slabFree(&pool->chunks, conn->decoder.in);
+    slabFree(&pool->chunks, conn->decoder.raw);
+    slabFree(&pool->chunks, conn->held);
+    slabFree(&pool->bundles, conn->bundle);
+    if (conn->outCapacity == OUT_BUFSZ)
+        slabFree(&pool->outputs, conn->out);
+    else
+        free(conn->out);
+    free(conn->batch);
+    free(conn->pending);
+    slabFree(&pool->contexts, conn);
+}
+
+/*
+ * Make room for `length` more bytes in the output buffer. The first buffer
+ * comes from the pool; replies that outgrow it move to the heap.
+ * Returns the room at the end of the queued output, or NULL if there is no
+ * memory left.
+ */
+static char *reserveOutput(struct Connection *conn, size_t length)
+{
+    if (conn->out == NULL && length <= OUT_BUFSZ)
+    {
+        conn->out = slabAlloc(&conn->pool->outputs);
+        if (conn->out == NULL)
+        {
+            return NULL;
+        }
+        conn->outCapacity = OUT_BUFSZ;
+    }
+    if (conn->outLength + length > conn->outCapacity)
+    {
+        size_t capacity = conn->outCapacity ? conn->outCapacity * 2 : OUT_BUFSZ * 2;
+        while (capacity < conn->outLength + length)
+        {
+            capacity *= 2;
+        }
+        char *out = malloc(capacity);
+        if (out == NULL)
+        {
+            return NULL;
+        }
+        if (conn->outLength > 0)
+        {
+            memcpy(out, conn->out, conn->outLength);
+        }
+        if (conn->outCapacity == OUT_BUFSZ)
+            slabFree(&conn->pool->outputs, conn->out);
+        else
+            free(conn->out);
+        conn->out = out;
+        conn->outCapacity = capacity;
+    }
+    return conn->out + conn->outLength;
+}
+
+/*
+ * Queue the header of a frame without a name and reserve room for its
+ * payload, filled in by the caller.
+ * Returns the payload room, or NULL if there is no memory left.
+ */
+static char *queueFrameHeader(struct Connection *conn, uint8_t opcode, uint32_t status,
+                              size_t length)
+{
+    char *room = reserveOutput(conn, FRAME_HEADER_SIZE + length);
+    if (room == NULL)
+    {
+        return NULL;
+    }
+
+    struct FrameHeader header;
+    initHeader(&header, opcode, 0, length);
+    header.status = status;
+    encodeHeader(&header, (unsigned char *)room);
+    conn->outLength += FRAME_HEADER_SIZE + length;
+    return room + FRAME_HEADER_SIZE;
+}
+
+/*
+ * Queue a frame without a name whose payload is in memory.
+ * Returns 0 on success, -1 on failure.
+ */
+static int queueFrame(struct Connection *conn, uint8_t opcode, uint32_t status,
+                      const void *payload, size_t length)
+{
+    char *room = queueFrameHeader(conn, opcode, status, length);
+    if (room == NULL)
+    {
+        return -1;
+    }
+    if (length > 0)
+    {
+        memcpy(room, payload, length);
+    }
+    return 0;
+}
+
+/*
+ * Remember the status of a file sent inside a batch.
+ * Returns 0 on success, -1 if there is no memory left.
+ */
+static int recordBatchStatus(struct Connection *conn, enum Status status)
+{
+    if (conn->batchLength == conn->batchCapacity)
+    {
+        size_t capacity = conn->batchCapacity ? conn->batchCapacity * 2 : 64;
+        uint32_t *batch = realloc(conn->batch, capacity * sizeof(uint32_t));
+        if (batch == NULL)
+        {
+            return -1;
+        }
+        conn->batch = batch;
+        conn->batchCapacity = capacity;
+    }
+    conn->batch[conn->batchLength++] = htonl(status);
+    return 0;
+}
+
+/*
+ * Queue the OP_BATCH_REPLY carrying the status of every file of the batch.
+ * Returns 0 on success, -1 on failure.
+ */
+static int queueBatchReply(struct Connection *conn)
+{
+    size_t length = conn->batchLength * sizeof(uint32_t);
+    logPrintf("batch of %zu files done\n", conn->batchLength);
+
+    conn->batching = 0;
+    conn->batchLength = 0;
+    return queueFrame(conn, OP_BATCH_REPLY, 0, conn->batch, length);
+}
+
+/*
+ * Queue an OP_REPLY frame with the status and the message "file <name> <verb>",
+ * or only record the status when the file is part of a batch.
+ * Returns 0 on success, -1 on failure.
+ */
+static int queueReply(struct Connection *conn, enum Status status, const char *verb)
+{
+    char message[MAX_NAME_LENGTH + 32];
+    int length = snprintf(message, sizeof(message), "file %s %s", conn->fileName, verb);
+    logPrintf("%s\n", message);
+
+    if (conn->batching)
+    {
+        return recordBatchStatus(conn, status);
+    }
+    return queueFrame(conn, OP_REPLY, status, message, length);
+}
+
+/*
+ * Remove the current file from the names that missed the store.
+ * Returns 1 if it was there, 0 otherwise.
+ */
+static int takePending(struct Connection *conn)
+{
+    for (size_t i = 0; i < conn->pendingLength; i++)
+    {
+        if (strcmp(conn->pending[i], conn->fileName) == 0)
+        {
+            conn->pendingLength--;
+            memcpy(conn->pending[i], conn->pending[conn->pendingLength], sizeof(conn->pending[i]));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Remember a name that missed the store, so its content is added once the
+ * client has sent it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int addPending(struct Connection *conn)
+{
+    if (conn->pendingLength == conn->pendingCapacity)
+    {
+        size_t capacity = conn->pendingCapacity ? conn->pendingCapacity * 2 : 16;
+        void *pending = realloc(conn->pending, capacity * sizeof(*conn->pending));
+        if (pending == NULL)
+        {
+            return -1;
+        }
+        conn->pending = pending;
+        conn->pendingCapacity = capacity;
+    }
+    strcpy(conn->pending[conn->pendingLength++], conn->fileName);
+    return 0;
+}
+
+/*
+ * Build the name of the ledger of the multi-stream transfer whose part file
+ * is conn->partName.
+ */
+static void ledgerName(const struct Connection *conn, char name[PART_NAME_SIZE + sizeof(LEDGER_SUFFIX)])
+{
+    snprintf(name, PART_NAME_SIZE + sizeof(LEDGER_SUFFIX), "%s%s", conn->partName, LEDGER_SUFFIX);
+}
+
+/*
+ * Append a range, once written, to the ledger of its transfer. Every range
+ * is a single append, so the connections of a transfer can record theirs
+ * whichever worker they are on.
+ * Returns 0 on success, -1 on failure.
+ */
+static int recordRange(struct Connection *conn)
+{
+    char name[PART_NAME_SIZE + sizeof(LEDGER_SUFFIX)];
+    uint64_t record[3] = {htobe64(conn->rangeOffset),
+                          htobe64(conn->header.payloadLength - RANGE_HEADER_SIZE),
+                          htobe64(conn->rangeTotal)};
+    ledgerName(conn, name);
+
+    int sync = diskSyncPolicy() != SYNC_NONE;
+    int fd = open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    int failed = fd == -1 || write(fd, record, sizeof(record)) != (ssize_t)sizeof(record) ||
+                 (sync && fdatasync(fd) != 0);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    conn->stats->syscalls += 3 + sync;
+    return failed ? -1 : 0;
+}
+
+/*
+ * A received file to add to the store, handed to a disk thread that
+ * releases it
+ */
+struct StoreJob
+{
+    struct DiskFile file;
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+static void storeJob(struct DiskFile *file)
+{
+    struct StoreJob *job = (struct StoreJob *)file;
+    storeAdd(job->name);
+    free(job);
+}
+
+/*
+ * Add a received file to the store. It is read whole, so this is left to a
+ * disk thread, and done right away only by a worker without any.
+ */
+static void addToStore(struct Connection *conn)
+{
+    struct StoreJob *job = conn->disk != NULL ? malloc(sizeof(*job)) : NULL;
+    if (job == NULL)
+    {
+        storeAdd(conn->fileName);
+        return;
+    }
+    diskFileInit(&job->file, NULL, -1);
+    strcpy(job->name, conn->fileName);
+    diskRun(conn->disk, &job->file, storeJob);
+}
+
+/*
+ * Close the destination file, move a complete .part file to its final name
+ * and queue the reply for the finished transfer. When the policy asks for
+ * it, files written from the event loop are synced here, and the rename is
+ * made durable before the reply; the disk threads do both for theirs.
+ * Returns 0 on success, -1 on failure.
+ */
+static int completeTransfer(struct Connection *conn)
+{
+    int renamed = 0;
+    if (conn->writeBehind)
+    {
+        conn->writeFailed |= conn->diskFile.failed;
+        renamed = conn->diskFile.renamed;
+        conn->writeBehind = 0;
+    }
+    else if (conn->file != -1 && !conn->writeFailed && diskSyncPolicy() != SYNC_NONE)
+    {
+        conn->writeFailed = fdatasync(conn->file) != 0;
+        conn->stats->syscalls++;
+    }
+
+    if (conn->file != -1)
+    {
+        // Keep the good chunks of a corrupted file for the client to resume
+        if (conn->corrupt && ftruncate(conn->file, conn->checkOffset) != 0)
+        {
+            conn->writeFailed = 1;
+        }
+        conn->stats->syscalls += conn->corrupt;
+
+        // Renamed while still open, so the lock on a shared .part is only
+        // released once it is out of the way of the next upload
+        if (conn->partial && !conn->writeFailed && !conn->corrupt && !renamed)
+        {
+            conn->writeFailed = rename(conn->partName, conn->fileName) != 0 ||
+                                (diskSyncPolicy() != SYNC_NONE && diskSyncDirectory() != 0);
+            renamed = !conn->writeFailed;
+            conn->stats->syscalls += 1 + (diskSyncPolicy() != SYNC_NONE);
+        }
+        if (conn->partial && !renamed && !conn->resumable)
+        {
+            unlink(conn->partName);
+            conn->stats->syscalls++;
+        }
+        close(conn->file);
+        conn->file = -1;
+        conn->stats->syscalls++;
+    }
+    if (conn->validName && conn->header.opcode == OP_RANGE && !conn->writeFailed)
+    {
+        conn->writeFailed = recordRange(conn) != 0;
+    }
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+    conn->stats->files++;
+    statsObserve(&conn->stats->transferMicros, statsMicros() - conn->transferStart);
+
+    // A range is only part of the file, added to the store on commit, and a
+    // corrupted file once it was resent
+    if (conn->validName && conn->header.opcode != OP_RANGE && !conn->corrupt &&
+        takePending(conn) && !conn->writeFailed)
+    {
+        addToStore(conn);
+    }
+
+    if (!conn->validName)
+        return queueReply(conn, STATUS_INVALID_NAME, "not valid");
+    if (conn->writeFailed)
+        return queueReply(conn, STATUS_ERROR, "not written");
+    if (conn->corrupt)
+    {
+        char verb[48];
+        snprintf(verb, sizeof(verb), "corrupted at byte %llu", (unsigned long long)conn->checkOffset);
+        return queueReply(conn, STATUS_CORRUPT, verb);
+    }
+    if (conn->overwrite)
+    {
+        fileCacheInvalidate(conn->cache, conn->fileName);
+        return queueReply(conn, STATUS_OVERWRITTEN, "overwritten");
+    }
+    return queueReply(conn, STATUS_RECEIVED, "received");
+}
+
+/*
+ * Finish the transfer once its payload was received. With write-behind the
+ * connection waits in STATE_WRITING until the disk threads are done with
+ * the file, and completes it in connectionDiskReady.
+ * Returns 0 on success, -1 on failure.
+ */
+static int finishTransfer(struct Connection *conn)
+{
+    if (!conn->writeBehind)
+    {
+        return completeTransfer(conn);
+    }
+    if (conn->diskBuffer != NULL)
+    {
+        diskWrite(conn->disk, conn->diskBuffer);
+        conn->diskBuffer = NULL;
+    }
+    // The file is moved into place once durable, with the rest of its group
+    if (conn->partial && !conn->corrupt && diskSyncPolicy() != SYNC_NONE)
+    {
+        conn->diskFile.from = conn->partName;
+        conn->diskFile.to = conn->fileName;
+    }
+    diskFinish(conn->disk, &conn->diskFile);
+    conn->state = STATE_WRITING;
+    return 0;
+}
+
+/*
+ * Hand the payload of a transfer to the disk threads instead of writing it
+ * from the event loop, unless it is decoded as it arrives.
+ */
+static void startWriteBehind(struct Connection *conn, uint64_t offset)
+{
+    conn->writeBehind = conn->disk != NULL && conn->disk->depth > 0 && !conn->writeFailed &&
+                        conn->state == STATE_PAYLOAD;
+    conn->diskOffset = offset;
+    if (conn->writeBehind)
+    {
+        diskFileInit(&conn->diskFile, conn, conn->file);
+    }
+}
+
+/*
+ * Copy payload bytes into pooled buffers, queueing each one once full.
+ * Returns the number of bytes taken, less than `length` when the pool is
+ * empty.
+ */
+static size_t queuePayload(struct Connection *conn, const char *data, size_t length)
+{
+    size_t queued = 0;
+    while (queued < length)
+    {
+        if (conn->diskBuffer == NULL)
+        {
+            conn->diskBuffer = diskBuffer(conn->disk, &conn->diskFile);
+            if (conn->diskBuffer == NULL)
+            {
+                break;
+            }
+            conn->diskBuffer->offset = conn->diskOffset;
+        }
+
+        struct DiskBuffer *buffer = conn->diskBuffer;
+        size_t taken = DISK_BUFSZ - buffer->length;
+        taken = taken < length - queued ? taken : length - queued;
+        if (conn->checked)
+        {
+            conn->checkCrc = crc32cCopy(conn->checkCrc, buffer->data + buffer->length,
+                                        data + queued, taken);
+        }
+        else
+        {
+            memcpy(buffer->data + buffer->length, data + queued, taken);
+        }
+        buffer->length += taken;
+        conn->diskOffset += taken;
+        queued += taken;
+
+        if (buffer->length == DISK_BUFSZ)
+        {
+            diskWrite(conn->disk, buffer);
+            conn->diskBuffer = NULL;
+        }
+    }
+    return queued;
+}
+
+/*
+ * Append a piece of the name being received, scanning only the new bytes:
+ * memchr finds a path separator or an embedded NUL, memrchr the last dot,
+ * so the name is never searched again once complete.
+ */
+static void appendName(struct Connection *conn, const char *piece, size_t length)
+{
+    if (conn->nameLength == 0)
+    {
+        conn->nameRejected = 0;
+        conn->extensionStart = 0;
+    }
+
+    memcpy(conn->fileName + conn->nameLength, piece, length);
+    if (memchr(piece, '/', length) != NULL || memchr(piece, '\0', length) != NULL)
+    {
+        conn->nameRejected = 1;
+    }
+    const char *dot = memrchr(piece, '.', length);
+    if (dot != NULL)
+    {
+        conn->extensionStart = conn->nameLength + (dot - piece) + 1;
+    }
+    conn->nameLength += length;
+}
+
+/*
+ * Check that the received name is a valid file name of a supported type,
+ * from what appendName found.
+ */
+static int nameIsValid(struct Connection *conn)
+{
+    conn->fileName[conn->nameLength] = '\0';
+    return !conn->nameRejected && conn->extensionStart > 0 &&
+           extensionIsValid(conn->fileName + conn->extensionStart,
+                            conn->nameLength - conn->extensionStart);
+}
+
+/*
+ * Build the name of the file the ranges of a multi-stream transfer go to,
+ * also used for the private file of a transfer that cannot be resumed.
+ */
+static void rangePartName(struct Connection *conn, uint64_t id)
+{
+    snprintf(conn->partName, sizeof(conn->partName), "%s.%016llx%s", conn->fileName,
+             (unsigned long long)id, PART_SUFFIX);
+}
+
+/*
+ * Pick the random id of the private file of a transfer.
+ */
+static uint64_t newTransferId(struct Connection *conn)
+{
+    uint64_t id;
+    conn->stats->syscalls++;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+    {
+        id = statsMicros();
+    }
+    return id;
+}
+
+/*
+ * Create the private file of a transfer that cannot be resumed. Nobody else
+ * knows its name, so no other upload of the same name can write to it.
+ * Returns the descriptor, or -1 on failure.
+ */
+static int openPrivatePart(struct Connection *conn, uint64_t id)
+{
+    rangePartName(conn, id);
+    conn->stats->syscalls++;
+    return open(conn->partName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+}
+
+/*
+ * Open the shared "<name>.part" of a resumable transfer, emptied unless it
+ * is resumed. It is locked for as long as it is written, so a second upload
+ * of the same name is refused instead of writing to the same inode, and
+ * must still be the .part file once locked, not the file its previous
+ * writer just renamed into place.
+ * Returns the descriptor, or -1 on failure.
+ */
+static int openSharedPart(struct Connection *conn, int resume)
+{
+    snprintf(conn->partName, sizeof(conn->partName), "%s%s", conn->fileName, PART_SUFFIX);
+    int fd = open(conn->partName, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    conn->stats->syscalls += 4 + !resume;
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    struct stat opened;
+    struct stat named;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &opened) != 0 ||
+        stat(conn->partName, &named) != 0 || opened.st_dev != named.st_dev ||
+        opened.st_ino != named.st_ino || (!resume && ftruncate(fd, 0) != 0))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Validate the received name and open the destination file. Files are only
+ * renamed to their name once complete, so a reader never sees half a file.
+ * They are written to a private "<name>.<id>.part" (`transferId`), or for a
+ * resumable transfer to "<name>.part", appended to when the client resumes
+ * at the offset it was given.
+ */
+static void startTransfer(struct Connection *conn)
+{
+    conn->validName = nameIsValid(conn);
+    conn->overwrite = 0;
+    conn->writeFailed = 0;
+    conn->writeBehind = 0;
+    conn->checked = 0;
+    conn->corrupt = 0;
+    conn->remaining = conn->header.payloadLength;
+    conn->state = STATE_PAYLOAD;
+    off_t offset = 0;
+
+    if (conn->validName)
+    {
+        int resume = conn->resumable && (conn->header.status & SEND_RESUME) &&
+                     strcmp(conn->resumeName, conn->fileName) == 0;
+        conn->overwrite = fileExists(conn->fileName);
+        conn->file = conn->resumable ? openSharedPart(conn, resume)
+                                     : openPrivatePart(conn, conn->transferId);
+        conn->stats->syscalls++;
+
+        offset = conn->file != -1 && resume ? lseek(conn->file, 0, SEEK_END) : 0;
+        if (resume && (uint64_t)offset != conn->resumeOffset)
+        {
+            // The partial file changed since its offset was announced
+            close(conn->file);
+            conn->file = -1;
+        }
+        conn->resumeName[0] = '\0';
+    }
+    conn->writeFailed = (conn->file == -1);
+
+    // Reserve the blocks up front so large files are laid out contiguously
+    if (!conn->writeFailed && conn->remaining >= SPLICE_MIN)
+    {
+        fallocate(conn->file, FALLOC_FL_KEEP_SIZE, offset, conn->remaining);
+        conn->stats->syscalls++;
+    }
+    conn->diskOffset = offset;
+}
+
+/*
+ * Answer an OP_RESUME request with the offset already stored in the
+ * partial file, or 0 if it cannot be resumed.
+ * Returns 0 on success, -1 on failure.
+ */
+static int handleResume(struct Connection *conn)
+{
+    uint64_t length;
+    memcpy(&length, conn->request, sizeof(length));
+    length = be64toh(length);
+
+    uint64_t offset = 0;
+    if (nameIsValid(conn))
+    {
+        struct stat st;
+        snprintf(conn->partName, sizeof(conn->partName), "%s%s", conn->fileName, PART_SUFFIX);
+        if (stat(conn->partName, &st) == 0 && (uint64_t)st.st_size <= length)
+        {
+            offset = st.st_size;
+        }
+        strcpy(conn->resumeName, conn->fileName);
+        conn->resumeOffset = offset;
+        conn->stats->syscalls++;
+    }
+    if (offset > 0)
+    {
+        logPrintf("file %s resumes at %llu\n", conn->fileName, (unsigned long long)offset);
+    }
+
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+
+    uint64_t wire = htobe64(offset);
+    return queueFrame(conn, OP_REPLY, STATUS_RESUME, &wire, sizeof(wire));
+}
+
+/*
+ * Create the looked up file from the store, from a disk thread: the stored
+ * content is read whole to check it still matches its digest. The new name
+ * is made durable here too when the policy asks for it.
+ */
+static void lookupTask(struct Connection *conn)
+{
+    conn->taskStatus = STATUS_MISSING;
+    if (storeLink(conn->request, conn->fileName, conn->partName) == 0)
+    {
+        conn->taskStatus = diskSyncPolicy() != SYNC_NONE && diskSyncDirectory() != 0
+                               ? STATUS_ERROR
+                               : STATUS_RECEIVED;
+    }
+}
+
+/*
+ * Answer an OP_LOOKUP request once lookupTask ran: the file was created,
+ * could not be made durable, or its content is asked for.
+ * Returns 0 on success, -1 on failure.
+ */
+static int finishLookup(struct Connection *conn)
+{
+    conn->stats->syscalls += 6;
+    if (conn->taskStatus == STATUS_ERROR)
+    {
+        return queueReply(conn, STATUS_ERROR, "not written");
+    }
+    if (conn->taskStatus == STATUS_RECEIVED)
+    {
+        conn->stats->files++;
+        if (conn->overwrite)
+        {
+            fileCacheInvalidate(conn->cache, conn->fileName);
+        }
+        return conn->overwrite ? queueReply(conn, STATUS_OVERWRITTEN, "overwritten (deduplicated)")
+                               : queueReply(conn, STATUS_RECEIVED, "received (deduplicated)");
+    }
+
+    if (addPending(conn) != 0)
+    {
+        return -1;
+    }
+    return queueFrame(conn, OP_REPLY, STATUS_MISSING, NULL, 0);
+}
+
+/*
+ * Compute the block signatures of the current copy of the file, from a disk
+ * thread since the whole file is read and hashed, into a buffer of their
+ * own: the event loop may be sending from the output buffer meanwhile.
+ * No copy, or no memory, leaves taskData empty.
+ */
+static void signatureTask(struct Connection *conn)
+{
+    conn->taskData = NULL;
+    conn->taskLength = 0;
+
+    int fd = open(conn->fileName, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    uint64_t length = st.st_size;
+    uint32_t blockSize = deltaBlockSize(length);
+    size_t size = DELTA_HEADER_SIZE + (length + blockSize - 1) / blockSize * DELTA_SIGNATURE_SIZE;
+    unsigned char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    unsigned char *payload = data != MAP_FAILED ? malloc(size) : NULL;
+    if (payload != NULL)
+    {
+        uint32_t wireBlock = htobe32(blockSize);
+        uint64_t wireLength = htobe64(length);
+        memcpy(payload, &wireBlock, 4);
+        memcpy(payload + 4, &wireLength, 8);
+        deltaSignatures(data, length, blockSize, payload + DELTA_HEADER_SIZE);
+        conn->taskData = payload;
+        conn->taskLength = size;
+    }
+    if (data != MAP_FAILED)
+    {
+        munmap(data, length);
+    }
+}
+
+/*
+ * Answer an OP_SIGNATURE request once signatureTask ran, with a block size
+ * of 0 if there is no copy of the file.
+ * Returns 0 on success, -1 on failure.
+ */
+static int finishSignature(struct Connection *conn)
+{
+    unsigned char empty[DELTA_HEADER_SIZE] = {0};
+    conn->stats->syscalls += 4;
+    if (conn->taskData == NULL)
+    {
+        return queueFrame(conn, OP_REPLY, STATUS_SIGNATURES, empty, sizeof(empty));
+    }
+    int queued = queueFrame(conn, OP_REPLY, STATUS_SIGNATURES, conn->taskData, conn->taskLength);
+    free(conn->taskData);
+    conn->taskData = NULL;
+    return queued;
+}
+
+/*
+ * Do the work of a request from a disk thread, or from the event loop of a
+ * worker without any.
+ */
+static void runTask(struct Connection *conn)
+{
+    switch (conn->task)
+    {
+    case TASK_LOOKUP:
+        lookupTask(conn);
+        break;
+    case TASK_SIGNATURE:
+        signatureTask(conn);
+        break;
+    case TASK_NONE:
+        break;
+    }
+}
+
+static void diskTask(struct DiskFile *file)
+{
+    runTask(file->owner);
+}
+
+/*
+ * Answer a request once the work of its task is done.
+ * Returns 0 on success, -1 on failure.
+ */
+static int finishTask(struct Connection *conn)
+{
+    enum ConnectionTask task = conn->task;
+    conn->task = TASK_NONE;
+    conn->state = STATE_HEADER;
+    switch (task)
+    {
+    case TASK_LOOKUP:
+        return finishLookup(conn);
+    case TASK_SIGNATURE:
+        return finishSignature(conn);
+    case TASK_NONE:
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Hand the work of a request that reads whole files to the disk threads,
+ * so it does not stall the other clients of the event loop. The connection
+ * waits in STATE_WRITING, its input held, until connectionDiskReady answers
+ * the request.
+ * Returns 0 on success, -1 on failure.
+ */
+static int startTask(struct Connection *conn, enum ConnectionTask task)
+{
+    conn->task = task;
+    if (conn->disk == NULL)
+    {
+        runTask(conn);
+        return finishTask(conn);
+    }
+    conn->state = STATE_WRITING;
+    diskFileInit(&conn->diskFile, conn, -1);
+    diskRun(conn->disk, &conn->diskFile, diskTask);
+    return 0;
+}
+
+/*
+ * Answer an OP_LOOKUP request: create the file from the content store if it
+ * holds the announced digest, or ask the client for the content.
+ * Returns 0 on success, -1 on failure.
+ */
+static int handleLookup(struct Connection *conn)
+{
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+
+    if (!nameIsValid(conn))
+    {
+        return queueReply(conn, STATUS_INVALID_NAME, "not valid");
+    }
+
+    rangePartName(conn, newTransferId(conn));
+    conn->overwrite = fileExists(conn->fileName);
+    conn->stats->syscalls++;
+    return startTask(conn, TASK_LOOKUP);
+}
+
+/*
+ * Answer an OP_SIGNATURE request with the block signatures of the current
+ * copy of the file, computed by signatureTask.
+ * Returns 0 on success, -1 on failure.
+ */
+static int handleSignature(struct Connection *conn)
+{
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+
+    if (!nameIsValid(conn))
+    {
+        unsigned char empty[DELTA_HEADER_SIZE] = {0};
+        return queueFrame(conn, OP_REPLY, STATUS_SIGNATURES, empty, sizeof(empty));
+    }
+    return startTask(conn, TASK_SIGNATURE);
+}
+
+/*
+ * Start rebuilding a file from its current copy and the delta that follows.
+ * The new content goes to a private "<name>.<id>.part", renamed over the
+ * file once complete.
+ */
+static void startDelta(struct Connection *conn)
+{
+    conn->validName = nameIsValid(conn);
+    conn->overwrite = 1;
+    conn->writeFailed = 1;
+    conn->partial = 1;
+    conn->resumable = 0;
+    conn->remaining = conn->header.payloadLength;
+    conn->state = STATE_DELTA;
+
+    if (conn->validName)
+    {
+        int basis = open(conn->fileName, O_RDONLY | O_CLOEXEC);
+        conn->file = openPrivatePart(conn, newTransferId(conn));
+        conn->stats->syscalls++;
+        deltaDecoderInit(&conn->delta, basis, conn->file);
+        conn->writeFailed = basis == -1 || conn->file == -1;
+    }
+}
+
+/*
+ * Finish a delta transfer: the new file is only kept if the delta was
+ * complete and every instruction applied.
+ * Returns 0 on success, -1 on failure.
+ */
+static int finishDelta(struct Connection *conn)
+{
+    if (!deltaDecoderDone(&conn->delta))
+    {
+        conn->writeFailed = 1;
+    }
+    if (conn->delta.basis != -1)
+    {
+        close(conn->delta.basis);
+        conn->delta.basis = -1;
+        conn->stats->syscalls++;
+    }
+    return finishTransfer(conn);
+}
+
+/*
+ * Start the next chunk of a checked transfer, `left` payload bytes before
+ * the end. A payload that ends inside a checksum is corrupt.
+ */
+static void startChunk(struct Connection *conn, uint64_t left)
+{
+    conn->checkCrc = 0;
+    conn->trailerLength = 0;
+    conn->checkChunk = left > CHUNKSZ + CHECKSUM_SIZE ? CHUNKSZ
+                       : left > CHECKSUM_SIZE         ? left - CHECKSUM_SIZE
+                                                      : 0;
+    conn->checkLeft = conn->checkChunk;
+    if (left > 0 && conn->checkChunk == 0)
+    {
+        conn->corrupt = 1;
+    }
+}
+
+/*
+ * Write the content of a chunk of a checked transfer, or queue it with
+ * write-behind, extending the checksum of the chunk on the way.
+ * Returns the number of bytes taken, less than `length` when the pool is
+ * empty.
+ */
+static size_t writeChecked(struct Connection *conn, const char *data, size_t length)
+{
+    if (conn->writeBehind)
+    {
+        return queuePayload(conn, data, length);
+    }
+    conn->checkCrc = crc32c(conn->checkCrc, data, length);
+    if (!conn->writeFailed && writeAll(conn->file, data, length) != 0)
+    {
+        conn->writeFailed = 1;
+    }
+    conn->stats->syscalls++;
+    return length;
+}
+
+/*
+ * Take payload bytes of a checked transfer: the content of each chunk is
+ * written as it arrives and its checksum compared with the one that follows
+ * it. From the first bad chunk on, the payload is only counted.
+ * Returns the number of bytes taken, less than `length` when the pool is
+ * empty.
+ */
+static size_t feedChecked(struct Connection *conn, const char *data, size_t length)
+{
+    size_t taken = 0;
+    while (taken < length && !conn->corrupt)
+    {
+        if (conn->checkLeft > 0)
+        {
+            size_t piece = conn->checkLeft < length - taken ? conn->checkLeft : length - taken;
+            size_t written = writeChecked(conn, data + taken, piece);
+            conn->checkLeft -= written;
+            taken += written;
+            if (written < piece)
+            {
+                return taken;
+            }
+            continue;
+        }
+
+        size_t piece = CHECKSUM_SIZE - conn->trailerLength;
+        piece = piece < length - taken ? piece : length - taken;
+        memcpy(conn->trailer + conn->trailerLength, data + taken, piece);
+        conn->trailerLength += piece;
+        taken += piece;
+        if (conn->trailerLength < CHECKSUM_SIZE)
+        {
+            break;
+        }
+
+        uint32_t expected;
+        memcpy(&expected, conn->trailer, CHECKSUM_SIZE);
+        if (ntohl(expected) != conn->checkCrc)
+        {
+            conn->corrupt = 1;
+            conn->stats->badChunks++;
+            break;
+        }
+        conn->checkOffset += conn->checkChunk;
+        startChunk(conn, conn->remaining - taken);
+    }
+    return conn->corrupt ? length : taken;
+}
+
+/*
+ * Start receiving a file. Compressed content is decompressed as it arrives,
+ * chunk by chunk, instead of being written as is, and checked content is
+ * verified chunk by chunk.
+ */
+static void startSend(struct Connection *conn)
+{
+    conn->partial = 1;
+    conn->resumable = (conn->header.status & (SEND_RESUME | SEND_CHECKED)) != 0;
+    conn->transferId = conn->resumable ? 0 : newTransferId(conn);
+    startTransfer(conn);
+
+    if (conn->header.status & SEND_CHECKED)
+    {
+        conn->checked = 1;
+        conn->checkOffset = conn->diskOffset;
+        startChunk(conn, conn->remaining);
+    }
+
+    if (conn->header.status & SEND_COMPRESSED)
+    {
+        conn->state = STATE_COMPRESSED;
+        unsigned char *in = slabAlloc(&conn->pool->chunks);
+        unsigned char *raw = slabAlloc(&conn->pool->chunks);
+        chunkDecoderInit(&conn->decoder, conn->file, in, raw);
+        if (in == NULL || raw == NULL)
+        {
+            conn->writeFailed = 1;
+        }
+        conn->decoder.failed = conn->writeFailed;
+    }
+    startWriteBehind(conn, conn->diskOffset);
+}
+
+/*
+ * Take bytes of a compressed transfer, decompressing them into the file.
+ * The content is not sized up front: it runs up to its CHUNK_END word, and
+ * the bytes after it belong to the next frame.
+ * Returns 0 on success, -1 if the end of the content can no longer be found.
+ */
+static int feedCompressed(struct Connection *conn, const char *data, size_t length,
+                          size_t *taken)
+{
+    long consumed = chunkDecoderFeed(&conn->decoder, data, length);
+    if (consumed < 0)
+    {
+        return -1;
+    }
+    *taken = consumed;
+    conn->writeFailed |= conn->decoder.failed;
+    conn->stats->bytesReceived += consumed;
+    return 0;
+}
+
+/*
+ * Finish a compressed transfer once the end of its content was reached.
+ * Returns 0 on success, -1 on failure.
+ */
+static int finishCompressed(struct Connection *conn)
+{
+    slabFree(&conn->pool->chunks, conn->decoder.in);
+    slabFree(&conn->pool->chunks, conn->decoder.raw);
+    conn->decoder.in = NULL;
+    conn->decoder.raw = NULL;
+    return finishTransfer(conn);
+}
+
+/*
+ * Answer an OP_HELLO request with the capabilities both sides support.
+ * Returns 0 on success, -1 on failure.
+ */
+static int handleHello(struct Connection *conn)
+{
+    uint32_t capabilities;
+    memcpy(&capabilities, conn->request, sizeof(capabilities));
+    conn->capabilities = ntohl(capabilities) & SERVER_CAPABILITIES;
+
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+
+    capabilities = htonl(conn->capabilities);
+    return queueFrame(conn, OP_REPLY, STATUS_HELLO, &capabilities, sizeof(capabilities));
+}
+
+/*
+ * Whether a directory entry is the part file or ledger of a transfer,
+ * "<name>.<transfer id>.part" with an optional LEDGER_SUFFIX. Clients cannot
+ * create such names, whose extension is not a supported type.
+ */
+static int isTransferPart(const char *name)
+{
+    size_t length = strlen(name);
+    size_t ledger = sizeof(LEDGER_SUFFIX) - 1;
+    size_t part = sizeof(PART_SUFFIX) - 1;
+    if (length > ledger && strcmp(name + length - ledger, LEDGER_SUFFIX) == 0)
+    {
+        length -= ledger;
+    }
+    if (length < 18 + part || strncmp(name + length - part, PART_SUFFIX, part) != 0 ||
+        name[length - part - 17] != '.')
+    {
+        return 0;
+    }
+    for (const char *id = name + length - part - 16; id < name + length - part; id++)
+    {
+        if (*id == '\0' || strchr("0123456789abcdef", *id) == NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Remove the part files and ledgers of transfers left untouched for
+ * PART_EXPIRY seconds, whose client gave up or whose server stopped before
+ * they were moved into place. A worker checks at most every
+ * PART_SWEEP_INTERVAL seconds, when a range arrives.
+ */
+static void sweepParts(struct Connection *conn)
+{
+    static time_t lastSweep;
+    time_t now = time(NULL);
+    if (now - lastSweep < PART_SWEEP_INTERVAL)
+    {
+        return;
+    }
+    lastSweep = now;
+
+    DIR *dir = opendir(".");
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (isTransferPart(entry->d_name) && stat(entry->d_name, &st) == 0 &&
+            S_ISREG(st.st_mode) && now - st.st_mtime > PART_EXPIRY)
+        {
+            logPrintf("removing abandoned %s\n", entry->d_name);
+            unlink(entry->d_name);
+        }
+        conn->stats->syscalls++;
+    }
+    closedir(dir);
+}
+
+/*
+ * Start receiving one range of a multi-stream transfer. Every range has its
+ * own descriptor on the shared file, positioned at the range offset, so the
+ * write, splice and io_uring paths all land where a pwrite at that offset
+ * would, without any coordination between connections or workers.
+ * Returns 0 on success, -1 on failure.
+ */
+static int startRange(struct Connection *conn)
+{
+    uint64_t fields[3];
+    memcpy(fields, conn->request, sizeof(fields));
+    uint64_t id = be64toh(fields[0]);
+    uint64_t offset = be64toh(fields[1]);
+    uint64_t total = be64toh(fields[2]);
+    uint64_t length = conn->header.payloadLength - RANGE_HEADER_SIZE;
+
+    if (offset > total || length > total - offset)
+    {
+        return -1;
+    }
+
+    conn->validName = nameIsValid(conn);
+    conn->overwrite = 0;
+    conn->partial = 0;
+    conn->resumable = 0;
+    conn->checked = 0;
+    conn->corrupt = 0;
+    conn->remaining = length;
+    conn->state = STATE_PAYLOAD;
+    conn->transferId = id;
+    conn->rangeOffset = offset;
+    conn->rangeTotal = total;
+    sweepParts(conn);
+
+    if (conn->validName)
+    {
+        rangePartName(conn, id);
+        conn->file = open(conn->partName, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        conn->stats->syscalls++;
+    }
+    conn->writeFailed = (conn->file == -1);
+
+    // The total comes from the client: the file may only grow to a length
+    // the file system still has room for
+    struct stat st;
+    struct statvfs fs;
+    if (!conn->writeFailed &&
+        (fstat(conn->file, &st) != 0 || fstatvfs(conn->file, &fs) != 0 ||
+         total > (uint64_t)st.st_blocks * 512 + (uint64_t)fs.f_bavail * fs.f_frsize))
+    {
+        conn->writeFailed = 1;
+    }
+    conn->stats->syscalls += 2;
+
+    // Preallocate the range, which also grows the file to its full length
+    // once the last range arrives
+    if (!conn->writeFailed && length > 0 &&
+        (fallocate(conn->file, 0, offset, length) != 0 ||
+         lseek(conn->file, offset, SEEK_SET) != (off_t)offset))
+    {
+        conn->writeFailed = 1;
+    }
+    conn->stats->syscalls += 2;
+    startWriteBehind(conn, offset);
+    return 0;
+}
+
+static int compareRecords(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+/*
+ * Check that the ranges recorded in the ledger of the transfer cover all
+ * of [0, total) and were all sent for that total. The length of the part
+ * file proves nothing, since preallocating the last range grows it to its
+ * full length while earlier ranges may still be missing.
+ * Returns 1 if the file is complete, 0 otherwise.
+ */
+static int rangesCover(struct Connection *conn, uint64_t total)
+{
+    char name[PART_NAME_SIZE + sizeof(LEDGER_SUFFIX)];
+    ledgerName(conn, name);
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    conn->stats->syscalls += 4;
+    if (fd == -1)
+    {
+        return total == 0;
+    }
+
+    struct stat st;
+    uint64_t *records = NULL;
+    size_t count = 0;
+    if (fstat(fd, &st) == 0 && st.st_size % LEDGER_RECORD_SIZE == 0 &&
+        st.st_size <= LEDGER_MAX_RECORDS * LEDGER_RECORD_SIZE &&
+        (records = malloc(st.st_size + 1)) != NULL &&
+        read(fd, records, st.st_size) == st.st_size)
+    {
+        count = st.st_size / LEDGER_RECORD_SIZE;
+    }
+    close(fd);
+
+    for (size_t i = 0; i < count * 3; i++)
+    {
+        records[i] = be64toh(records[i]);
+    }
+    qsort(records, count, LEDGER_RECORD_SIZE, compareRecords);
+
+    uint64_t covered = 0;
+    for (size_t i = 0; i < count && covered != UINT64_MAX; i++)
+    {
+        uint64_t *record = records + i * 3;
+        if (record[2] != total || record[0] > covered)
+        {
+            covered = UINT64_MAX;
+        }
+        else if (record[0] + record[1] > covered)
+        {
+            covered = record[0] + record[1];
+        }
+    }
+    free(records);
+    return count > 0 && covered == total;
+}
+
+/*
+ * Answer an OP_COMMIT request: move the file of a multi-stream transfer
+ * into place once its ledger shows every byte of it was written.
+ * Returns 0 on success, -1 on failure.
+ */
+static int handleCommit(struct Connection *conn)
+{
+    uint64_t fields[2];
+    memcpy(fields, conn->request, sizeof(fields));
+    uint64_t id = be64toh(fields[0]);
+    uint64_t total = be64toh(fields[1]);
+
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+
+    if (!nameIsValid(conn))
+    {
+        return queueReply(conn, STATUS_INVALID_NAME, "not valid");
+    }
+
+    struct stat st;
+    char ledger[PART_NAME_SIZE + sizeof(LEDGER_SUFFIX)];
+    rangePartName(conn, id);
+    ledgerName(conn, ledger);
+    int overwrite = fileExists(conn->fileName);
+    conn->stats->syscalls += 4;
+    if (stat(conn->partName, &st) != 0 || (uint64_t)st.st_size != total ||
+        !rangesCover(conn, total) || rename(conn->partName, conn->fileName) != 0 ||
+        (diskSyncPolicy() != SYNC_NONE && diskSyncDirectory() != 0))
+    {
+        return queueReply(conn, STATUS_ERROR, "not written");
+    }
+    unlink(ledger);
+    conn->stats->files++;
+
+    if (takePending(conn))
+    {
+        addToStore(conn);
+    }
+    if (overwrite)
+    {
+        fileCacheInvalidate(conn->cache, conn->fileName);
+    }
+    return overwrite ? queueReply(conn, STATUS_OVERWRITTEN, "overwritten")
+                     : queueReply(conn, STATUS_RECEIVED, "received");
+}
+
+/*
+ * Find the content of the requested file: its mapping in the hot-file cache
+ * when it is there or fits in it, the open file otherwise. A cache hit only
+ * costs a stat, which tells whether the file changed since it was mapped.
+ * Returns the size of the file, or -1 if it is not a readable regular file.
+ */
+static int64_t openContent(struct Connection *conn)
+{
+    struct stat st;
+    if (conn->cache != NULL)
+    {
+        conn->stats->syscalls++;
+        if (stat(conn->fileName, &st) == 0 &&
+            (conn->sendCached = fileCacheLookup(conn->cache, conn->fileName, &st)) != NULL)
+        {
+            return conn->sendCached->size;
+        }
+    }
+
+    int fd = open(conn->fileName, O_RDONLY | O_CLOEXEC);
+    conn->stats->syscalls += 2;
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (conn->cache != NULL &&
+        (conn->sendCached = fileCacheAdd(conn->cache, conn->fileName, fd, &st)) != NULL)
+    {
+        close(fd);
+        return conn->sendCached->size;
+    }
+    conn->sendFile = fd;
+    return st.st_size;
+}
+
+/*
+ * Answer an OP_GET request with the size of the file and the requested
+ * range of its content. Only the reply header is queued here: the content
+ * is sent straight from the cache or the file by connectionFlush, or copied
+ * piece by piece by connectionFillOutput, while the connection waits in
+ * STATE_SENDING.
+ * Returns 0 on success, -1 on failure.
+ */
+static int handleGet(struct Connection *conn)
+{
+    uint64_t fields[2];
+    memcpy(fields, conn->request, sizeof(fields));
+    uint64_t offset = be64toh(fields[0]);
+    uint64_t length = be64toh(fields[1]);
+
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+
+    if (!nameIsValid(conn))
+    {
+        return queueReply(conn, STATUS_INVALID_NAME, "not valid");
+    }
+
+    int64_t found = openContent(conn);
+    if (found == -1)
+    {
+        return queueReply(conn, STATUS_MISSING, "not found");
+    }
+
+    uint64_t size = found;
+    if (offset > size)
+    {
+        releaseContent(conn);
+        return queueReply(conn, STATUS_ERROR, "range not satisfiable");
+    }
+    if (length == 0 || length > size - offset)
+    {
+        length = size - offset;
+    }
+
+    char *room = queueFrameHeader(conn, OP_REPLY, STATUS_CONTENT, CONTENT_HEADER_SIZE);
+    if (room == NULL)
+    {
+        releaseContent(conn);
+        return -1;
+    }
+    // The frame announces the content that follows the size
+    struct FrameHeader header;
+    initHeader(&header, OP_REPLY, 0, CONTENT_HEADER_SIZE + length);
+    header.status = STATUS_CONTENT;
+    encodeHeader(&header, (unsigned char *)room - FRAME_HEADER_SIZE);
+    uint64_t total = htobe64(size);
+    memcpy(room, &total, sizeof(total));
+    logPrintf("file %s sent (%llu bytes at %llu)\n", conn->fileName,
+              (unsigned long long)length, (unsigned long long)offset);
+    conn->stats->downloads++;
+
+    if (length == 0)
+    {
+        releaseContent(conn);
+        return 0;
+    }
+    conn->sendOffset = offset;
+    conn->sendRemaining = length;
+    conn->state = STATE_SENDING;
+    return 0;
+}
+
+/*
+ * Handle a request whose name and payload were completely received.
+ * Returns 0 on success, -1 on failure.
+ */
+static int handleRequest(struct Connection *conn)
+{
+    switch (conn->header.opcode)
+    {
+    case OP_RESUME:
+        return handleResume(conn);
+    case OP_LOOKUP:
+        return handleLookup(conn);
+    case OP_SIGNATURE:
+        return handleSignature(conn);
+    case OP_RANGE:
+        return startRange(conn);
+    case OP_COMMIT:
+        return handleCommit(conn);
+    case OP_HELLO:
+        return handleHello(conn);
+    case OP_GET:
+        return handleGet(conn);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Group commit of the files of a bundle, left by unpackBundle in their
+ * private .part files, numbered from `base`: one syncfs makes all of them durable, then they are renamed
+ * into place and one fsync of the directory makes the renames durable
+ * before any of their statuses is sent.
+ * Returns 0 on success, -1 on failure.
+ */
+static int commitBundle(struct Connection *conn, uint32_t count, uint64_t base)
+{
+    const unsigned char *p = (const unsigned char *)conn->bundle;
+    int failed = diskSyncAll() != 0;
+    size_t entry = 4;
+    conn->stats->syscalls++;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t nameLength;
+        memcpy(&nameLength, p + entry, 2);
+        nameLength = ntohs(nameLength);
+        conn->nameLength = 0;
+        appendName(conn, (const char *)p + entry + BUNDLE_ENTRY_SIZE, nameLength);
+        entry += BUNDLE_ENTRY_SIZE + nameLength;
+
+        conn->validName = nameIsValid(conn);
+        conn->overwrite = 0;
+        conn->writeFailed = failed;
+        if (conn->validName)
+        {
+            rangePartName(conn, base + i);
+            conn->overwrite = fileExists(conn->fileName);
+            if (conn->writeFailed || rename(conn->partName, conn->fileName) != 0)
+            {
+                conn->writeFailed = 1;
+                unlink(conn->partName);
+            }
+            conn->stats->syscalls += 2;
+        }
+        if (completeTransfer(conn) != 0)
+        {
+            return -1;
+        }
+    }
+
+    // The statuses of the bundle are the last ones of the batch
+    conn->stats->syscalls++;
+    if (diskSyncDirectory() != 0)
+    {
+        for (size_t i = conn->batchLength - count; i < conn->batchLength; i++)
+        {
+            conn->batch[i] = htonl(STATUS_ERROR);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Store every file of a completely received bundle, with one write per file
+ * straight from the bundle buffer, and record their statuses. With a group
+ * commit the files are only moved into place by commitBundle, once all of
+ * them are written.
+ * Returns 0 on success, -1 if the bundle is malformed.
+ */
+static int unpackBundle(struct Connection *conn)
+{
+    const unsigned char *p = (const unsigned char *)conn->bundle;
+    size_t length = conn->bundleLength;
+    uint32_t count;
+
+    if (length < 4)
+    {
+        return -1;
+    }
+    memcpy(&count, p, 4);
+    count = ntohl(count);
+
+    // Find where the data starts before touching any file
+    size_t indexEnd = 4;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t nameLength;
+        if (indexEnd + BUNDLE_ENTRY_SIZE > length)
+        {
+            return -1;
+        }
+        memcpy(&nameLength, p + indexEnd, 2);
+        indexEnd += BUNDLE_ENTRY_SIZE + ntohs(nameLength);
+    }
+    if (indexEnd > length)
+    {
+        return -1;
+    }
+
+    const char *data = conn->bundle + indexEnd;
+    size_t dataLength = length - indexEnd;
+    size_t entry = 4;
+    int grouped = diskSyncPolicy() == SYNC_GROUP;
+    uint64_t base = newTransferId(conn);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t nameLength;
+        uint32_t offset;
+        uint32_t fileLength;
+        memcpy(&nameLength, p + entry, 2);
+        memcpy(&offset, p + entry + 2, 4);
+        memcpy(&fileLength, p + entry + 6, 4);
+        nameLength = ntohs(nameLength);
+        offset = ntohl(offset);
+        fileLength = ntohl(fileLength);
+
+        if (nameLength == 0 || nameLength > MAX_NAME_LENGTH || offset > dataLength ||
+            fileLength > dataLength - offset)
+        {
+            return -1;
+        }
+        conn->nameLength = 0;
+        appendName(conn, (const char *)p + entry + BUNDLE_ENTRY_SIZE, nameLength);
+        conn->header.payloadLength = fileLength;
+        entry += BUNDLE_ENTRY_SIZE + nameLength;
+
+        conn->partial = 1;
+        conn->resumable = 0;
+        conn->transferId = base + i;
+        startTransfer(conn);
+        if (!conn->writeFailed && writeAll(conn->file, data + offset, fileLength) != 0)
+        {
+            conn->writeFailed = 1;
+        }
+        conn->stats->syscalls++;
+        if (grouped)
+        {
+            // Kept in its .part file until commitBundle, unless it failed
+            if (conn->file != -1)
+            {
+                if (conn->writeFailed)
+                {
+                    unlink(conn->partName);
+                }
+                close(conn->file);
+                conn->file = -1;
+            }
+            conn->stats->bytesReceived += fileLength;
+            conn->stats->syscalls += 2;
+            continue;
+        }
+        if (connectionPayloadWritten(conn, fileLength) != 0)
+        {
+            return -1;
+        }
+    }
+    if (grouped && commitBundle(conn, count, base) != 0)
+    {
+        return -1;
+    }
+
+    slabFree(&conn->pool->bundles, conn->bundle);
+    conn->bundle = NULL;
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+
+    if (conn->bundleReply)
+    {
+        conn->bundleReply = 0;
+        return queueBatchReply(conn);
+    }
+    return 0;
+}
+
+/*
+ * Check the name and payload length of a request answered on its own.
+ * None of them may be part of a batch, whose only answer is its
+ * OP_BATCH_REPLY.
+ */
+static int requestIsValid(const struct Connection *conn)
+{
+    const struct FrameHeader *header = &conn->header;
+    int named = header->nameLength > 0 && header->nameLength <= MAX_NAME_LENGTH;
+
+    switch (header->opcode)
+    {
+    case OP_RESUME:
+        return named && header->payloadLength == sizeof(uint64_t) && !conn->batching;
+    case OP_LOOKUP:
+        return named && header->payloadLength == SHA256_SIZE && !conn->batching;
+    case OP_SIGNATURE:
+        return named && header->payloadLength == 0 && !conn->batching;
+    case OP_COMMIT:
+        return named && header->payloadLength == COMMIT_SIZE && !conn->batching;
+    case OP_HELLO:
+        return header->nameLength == 0 && header->payloadLength == HELLO_SIZE && !conn->batching;
+    case OP_GET:
+        return named && header->payloadLength == GET_SIZE && !conn->batching;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Handle a complete frame header.
+ * Returns 0 on success, -1 if the frame is not acceptable.
+ */
+static int handleHeader(struct Connection *conn)
+{
+    conn->transferStart = statsMicros();
+    if (decodeHeader(conn->headerBytes, &conn->header) != 0)
+    {
+        logPrintf("invalid frame from %s\n", conn->address);
+        return -1;
+    }
+
+    switch (conn->header.opcode)
+    {
+    case OP_SEND:
+        if (conn->header.nameLength == 0 || conn->header.nameLength > MAX_NAME_LENGTH ||
+            ((conn->header.status & SEND_COMPRESSED) &&
+             (!(conn->capabilities & CAP_COMPRESS) || conn->header.payloadLength != 0)) ||
+            ((conn->header.status & SEND_CHECKED) &&
+             (!(conn->capabilities & CAP_CHECKSUM) || (conn->header.status & SEND_COMPRESSED))))
+        {
+            return -1;
+        }
+        conn->nameLength = 0;
+        conn->state = STATE_NAME;
+        return 0;
+    case OP_DELTA:
+        if (conn->header.nameLength == 0 || conn->header.nameLength > MAX_NAME_LENGTH ||
+            conn->header.payloadLength < DELTA_HEADER_SIZE)
+        {
+            return -1;
+        }
+        conn->nameLength = 0;
+        conn->state = STATE_NAME;
+        return 0;
+    case OP_RANGE:
+        // Only the range header is read as a request, the content follows
+        if (conn->header.nameLength == 0 || conn->header.nameLength > MAX_NAME_LENGTH ||
+            conn->header.payloadLength < RANGE_HEADER_SIZE)
+        {
+            return -1;
+        }
+        conn->nameLength = 0;
+        conn->requestLength = 0;
+        conn->requestExpected = RANGE_HEADER_SIZE;
+        conn->state = STATE_NAME;
+        return 0;
+    case OP_RESUME:
+    case OP_LOOKUP:
+    case OP_SIGNATURE:
+    case OP_COMMIT:
+    case OP_HELLO:
+    case OP_GET:
+        if (!requestIsValid(conn))
+        {
+            return -1;
+        }
+        conn->nameLength = 0;
+        conn->requestLength = 0;
+        conn->requestExpected = conn->header.payloadLength;
+        conn->state = conn->header.nameLength > 0 ? STATE_NAME : STATE_REQUEST;
+        return 0;
+    case OP_EXIT:
+        logPrintf("connection closed\n");
+        conn->state = STATE_CLOSING;
+        return 0;
+    case OP_BUNDLE:
+        if (conn->header.nameLength != 0 || conn->header.payloadLength > BUNDLE_MAX)
+        {
+            logPrintf("invalid frame from %s\n", conn->address);
+            return -1;
+        }
+        conn->bundle = slabAlloc(&conn->pool->bundles);
+        if (conn->bundle == NULL)
+        {
+            return -1;
+        }
+        conn->bundleLength = 0;
+        conn->bundleReply = !conn->batching;
+        conn->batching = 1;
+        conn->state = STATE_BUNDLE;
+        return conn->header.payloadLength == 0 ? unpackBundle(conn) : 0;
+    case OP_BATCH_BEGIN:
+    case OP_BATCH_END:
+        if (conn->header.nameLength != 0 || conn->header.payloadLength != 0 ||
+            conn->batching != (conn->header.opcode == OP_BATCH_END))
+        {
+            logPrintf("invalid frame from %s\n", conn->address);
+            return -1;
+        }
+        conn->headerLength = 0;
+        if (conn->header.opcode == OP_BATCH_BEGIN)
+        {
+            conn->batching = 1;
+            return 0;
+        }
+        return queueBatchReply(conn);
+    default:
+        logPrintf("invalid frame from %s\n", conn->address);
+        return -1;
+    }
+}
+
+/*
+ * Whether the connection stops consuming input until something else is
+ * done: the disk threads in STATE_WRITING, a download in STATE_SENDING.
+ */
+static int connectionWaits(const struct Connection *conn)
+{
+    return conn->state == STATE_WRITING || conn->state == STATE_SENDING;
+}
+
+/*
+ * Keep the bytes that follow a point where the connection waits, fed again
+ * by feedHeld once it goes on. They come from a single receive, so they
+ * always fit in a CHUNKSZ buffer of the pool.
+ * Returns 0 on success, -1 on failure.
+ */
+static int holdInput(struct Connection *conn, const char *data, size_t length)
+{
+    if (length > CHUNKSZ)
+    {
+        return -1;
+    }
+    if (conn->held == NULL && (conn->held = slabAlloc(&conn->pool->chunks)) == NULL)
+    {
+        return -1;
+    }
+    memmove(conn->held, data, length);
+    conn->heldLength = length;
+    return 0;
+}
+
+/*
+ * Consume bytes received from the client, advancing the state machine.
+ * Payload bytes are written to the destination file as they arrive, or
+ * queued for the disk threads with write-behind.
+ * Returns 0 to keep the connection, -1 to drop it.
+ */
+int connectionFeed(struct Connection *conn, const char *data, size_t length)
+{
+    while (length > 0 && conn->state != STATE_CLOSING && !connectionWaits(conn))
+    {
+        size_t taken;
+
+        switch (conn->state)
+        {
+        case STATE_HEADER:
+            taken = FRAME_HEADER_SIZE - conn->headerLength;
+            taken = taken < length ? taken : length;
+            memcpy(conn->headerBytes + conn->headerLength, data, taken);
+            conn->headerLength += taken;
+            if (conn->headerLength == FRAME_HEADER_SIZE && handleHeader(conn) != 0)
+            {
+                return -1;
+            }
+            break;
+        case STATE_NAME:
+            taken = conn->header.nameLength - conn->nameLength;
+            taken = taken < length ? taken : length;
+            appendName(conn, data, taken);
+            if (conn->nameLength < conn->header.nameLength)
+            {
+                break;
+            }
+            if (conn->header.opcode == OP_SEND)
+            {
+                startSend(conn);
+            }
+            else if (conn->header.opcode == OP_DELTA)
+            {
+                startDelta(conn);
+            }
+            else
+            {
+                conn->state = STATE_REQUEST;
+            }
+            break;
+        case STATE_REQUEST:
+            taken = conn->requestExpected - conn->requestLength;
+            taken = taken < length ? taken : length;
+            memcpy(conn->request + conn->requestLength, data, taken);
+            conn->requestLength += taken;
+            break;
+        case STATE_DELTA:
+            taken = conn->remaining < length ? (size_t)conn->remaining : length;
+            if (!conn->writeFailed && deltaDecoderFeed(&conn->delta, data, taken) != 0)
+            {
+                conn->writeFailed = 1;
+            }
+            conn->remaining -= taken;
+            conn->stats->bytesReceived += taken;
+            break;
+        case STATE_COMPRESSED:
+            if (feedCompressed(conn, data, length, &taken) != 0)
+            {
+                return -1;
+            }
+            break;
+        case STATE_PAYLOAD:
+            taken = conn->remaining < length ? (size_t)conn->remaining : length;
+            if (conn->checked)
+            {
+                size_t checked = feedChecked(conn, data, taken);
+                if (checked < taken)
+                {
+                    // Wait in STATE_WRITING until a buffer is free again
+                    conn->state = STATE_WRITING;
+                    taken = checked;
+                }
+            }
+            else if (conn->writeBehind)
+            {
+                size_t queued = queuePayload(conn, data, taken);
+                if (queued < taken)
+                {
+                    // Wait in STATE_WRITING until a buffer is free again
+                    conn->state = STATE_WRITING;
+                    taken = queued;
+                }
+            }
+            else
+            {
+                if (!conn->writeFailed && writeAll(conn->file, data, taken) != 0)
+                {
+                    conn->writeFailed = 1;
+                }
+                conn->stats->syscalls++;
+            }
+            conn->remaining -= taken;
+            conn->stats->bytesReceived += taken;
+            break;
+        case STATE_BUNDLE:
+            taken = conn->header.payloadLength - conn->bundleLength;
+            taken = taken < length ? taken : length;
+            memcpy(conn->bundle + conn->bundleLength, data, taken);
+            conn->bundleLength += taken;
+            if (conn->bundleLength == conn->header.payloadLength && unpackBundle(conn) != 0)
+            {
+                logPrintf("invalid bundle from %s\n", conn->address);
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+
+        data += taken;
+        length -= taken;
+
+        if (conn->state == STATE_REQUEST && conn->requestLength == conn->requestExpected &&
+            handleRequest(conn) != 0)
+        {
+            return -1;
+        }
+        if (conn->state == STATE_PAYLOAD && conn->remaining == 0 && finishTransfer(conn) != 0)
+        {
+            return -1;
+        }
+        if (conn->state == STATE_DELTA && conn->remaining == 0 && finishDelta(conn) != 0)
+        {
+            return -1;
+        }
+        if (conn->state == STATE_COMPRESSED && chunkDecoderDone(&conn->decoder) &&
+            finishCompressed(conn) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (connectionWaits(conn) && length > 0)
+    {
+        return holdInput(conn, data, length);
+    }
+    return 0;
+}
+
+/*
+ * Feed the bytes held while the connection waited.
+ * Returns 0 to keep the connection, -1 to drop it.
+ */
+static int feedHeld(struct Connection *conn)
+{
+    size_t length = conn->heldLength;
+    conn->heldLength = 0;
+    if (length > 0 && connectionFeed(conn, conn->held, length) != 0)
+    {
+        return -1;
+    }
+
+    // Unless the connection waits again, the buffer goes back to the pool
+    if (conn->heldLength == 0)
+    {
+        slabFree(&conn->pool->chunks, conn->held);
+        conn->held = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Whether the connection is ready for more input: it does not wait and the
+ * client reads its replies.
+ */
+int connectionWantsInput(const struct Connection *conn)
+{
+    return conn->state != STATE_CLOSING && !connectionWaits(conn) &&
+           connectionPendingOutput(conn) < OUT_HIGH_WATER;
+}
+
+/*
+ * Continue a connection handed back by the disk threads: answer the request
+ * whose task they ran, complete the transfer they finished, or go on
+ * queueing the payload now that a buffer is free, then feed the bytes held
+ * meanwhile. The caller reads from the
+ * socket again afterwards.
+ * Returns 0 to keep the connection, -1 to drop it.
+ */
+int connectionDiskReady(struct Connection *conn)
+{
+    if (conn->state != STATE_WRITING)
+    {
+        return 0;
+    }
+    if (conn->task != TASK_NONE)
+    {
+        if (!conn->diskFile.done)
+        {
+            return 0;
+        }
+        if (finishTask(conn) != 0)
+        {
+            return -1;
+        }
+    }
+    else if (conn->diskFile.finishing)
+    {
+        if (!conn->diskFile.done)
+        {
+            return 0;
+        }
+        if (completeTransfer(conn) != 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        conn->state = STATE_PAYLOAD;
+    }
+    return feedHeld(conn);
+}
+
+/*
+ * Account for payload bytes that an I/O engine moved to the destination file
+ * by itself, finishing the transfer after the last one.
+ * Returns 0 on success, -1 on failure.
+ */
+int connectionPayloadWritten(struct Connection *conn, size_t length)
+{
+    conn->remaining -= length;
+    conn->stats->bytesReceived += length;
+
+    if (conn->remaining == 0)
+        return finishTransfer(conn);
+    return 0;
+}
+
+/*
+ * Whether the next payload bytes can be moved with connectionSplice.
+ */
+int connectionCanSplice(const struct Connection *conn)
+{
+    return conn->state == STATE_PAYLOAD && !conn->writeFailed && !conn->noSplice &&
+           !conn->checked && !conn->writeBehind && conn->remaining >= SPLICE_MIN;
+}
+
+/*
+ * Empty the pipe into the destination file through a user-space buffer, for
+ * file systems that do not accept splice. Once writing failed the bytes are
+ * only discarded.
+ */
+static void drainPipe(struct Connection *conn, int pipeIn, size_t length)
+{
+    char buf[4096];
+    while (length > 0)
+    {
+        ssize_t count = read(pipeIn, buf, length < sizeof(buf) ? length : sizeof(buf));
+        if (count <= 0)
+            return;
+        if (!conn->writeFailed && writeAll(conn->file, buf, count) != 0)
+            conn->writeFailed = 1;
+        length -= count;
+    }
+}
+
+/*
+ * Move payload bytes from the socket to the destination file through the
+ * pipe, without copying them to user space. The pipe is always left empty.
+ * Returns 1 if bytes were moved, 0 if the socket would block and -1 if the
+ * connection failed.
+ */
+int connectionSplice(struct Connection *conn, const int pipeFds[2])
+{
+    size_t wanted = conn->remaining < CHUNKSZ * 16 ? (size_t)conn->remaining : CHUNKSZ * 16;
+    ssize_t count = splice(conn->socket, NULL, pipeFds[1], NULL, wanted,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    conn->stats->syscalls++;
+    // The peer closed the connection in the middle of the payload
+    if (count == 0)
+        return -1;
+    if (count == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        return -1;
+    }
+    statsObserve(&conn->stats->recvSizes, count);
+
+    size_t pending = count;
+    while (pending > 0)
+    {
+        ssize_t written = splice(pipeFds[0], NULL, conn->file, NULL, pending, SPLICE_F_MOVE);
+        conn->stats->syscalls++;
+        // Nothing moved out of a pipe holding data sets no errno: the bytes
+        // cannot be accounted for, so the connection is closed
+        if (written == 0)
+        {
+            conn->writeFailed = 1;
+            drainPipe(conn, pipeFds[0], pending);
+            return -1;
+        }
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written == -1)
+        {
+            if (errno == EINVAL)
+                conn->noSplice = 1;
+            else
+                conn->writeFailed = 1;
+            drainPipe(conn, pipeFds[0], pending);
+            break;
+        }
+        pending -= written;
+    }
+
+    if (connectionPayloadWritten(conn, count) != 0)
+        return -1;
+    return 1;
+}
+
+/*
+ * Number of reply bytes that are queued but not yet sent.
+ */
+size_t connectionPendingOutput(const struct Connection *conn)
+{
+    return conn->outLength - conn->outSent;
+}
+
+/*
+ * Account for download bytes that went out, closing the file and feeding
+ * the input held meanwhile after the last one.
+ * Returns 0 on success, -1 on failure.
+ */
+static int contentSent(struct Connection *conn, size_t length)
+{
+    conn->sendOffset += length;
+    conn->sendRemaining -= length;
+    if (conn->sendRemaining > 0)
+    {
+        return 0;
+    }
+
+    releaseContent(conn);
+    conn->state = STATE_HEADER;
+    conn->headerLength = 0;
+    return feedHeld(conn);
+}
+
+/*
+ * Send as much of the queued output as the non-blocking socket accepts,
+ * followed by the content of a download: straight from its mapping when it
+ * is cached, else moved from the page cache to the socket with sendfile.
+ * Returns 1 when everything was sent, 0 if the socket would block and
+ * -1 on failure.
+ */
+int connectionFlush(struct Connection *conn)
+{
+    while (1)
+    {
+        while (conn->outSent < conn->outLength)
+        {
+            ssize_t count = send(conn->socket, conn->out + conn->outSent,
+                                 conn->outLength - conn->outSent, MSG_NOSIGNAL);
+            conn->stats->syscalls++;
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (count <= 0)
+                return -1;
+            conn->outSent += count;
+            conn->stats->bytesSent += count;
+        }
+        conn->outLength = 0;
+        conn->outSent = 0;
+
+        if (conn->state != STATE_SENDING)
+            return 1;
+
+        off_t offset = conn->sendOffset;
+        size_t wanted = conn->sendRemaining < CHUNKSZ * 16 ? (size_t)conn->sendRemaining
+                                                           : CHUNKSZ * 16;
+        ssize_t count = conn->sendCached != NULL
+                            ? send(conn->socket, conn->sendCached->data + offset, wanted,
+                                   MSG_NOSIGNAL)
+                            : sendfile(conn->socket, conn->sendFile, &offset, wanted);
+        conn->stats->syscalls++;
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        // A file that shrank cannot fill the announced frame any more
+        if (count <= 0)
+            return -1;
+        conn->stats->bytesSent += count;
+        if (contentSent(conn, count) != 0)
+            return -1;
+    }
+}
+
+/*
+ * Copy the next piece of a download into the empty output buffer, for I/O
+ * engines that only send from memory.
+ * Returns 0 on success, -1 on failure.
+ */
+int connectionFillOutput(struct Connection *conn)
+{
+    if (conn->state != STATE_SENDING || connectionPendingOutput(conn) > 0)
+    {
+        return 0;
+    }
+
+    size_t wanted = conn->sendRemaining < CHUNKSZ ? (size_t)conn->sendRemaining : CHUNKSZ;
+    char *room = reserveOutput(conn, wanted);
+    if (room == NULL)
+    {
+        return -1;
+    }
+    ssize_t count = wanted;
+    if (conn->sendCached != NULL)
+    {
+        memcpy(room, conn->sendCached->data + conn->sendOffset, wanted);
+    }
+    else
+    {
+        count = pread(conn->sendFile, room, wanted, conn->sendOffset);
+        conn->stats->syscalls++;
+    }
+    if (count <= 0)
+    {
+        return -1;
+    }
+    conn->outLength += count;
+    return contentSent(conn, count);
+}
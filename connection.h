@@ -0,0 +1,206 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "compress.h"
+#include "delta.h"
+#include "disk.h"
+#include "filecache.h"
+#include "protocol.h"
+#include "slab.h"
+#include "stats.h"
+
+#define ADDRSTRSZ 64
+
+// Stop reading from a client while this many reply bytes are unsent
+#define OUT_HIGH_WATER (16 * 1024)
+
+// Size of the pooled reply buffer of a connection, grown on the heap if needed
+#define OUT_BUFSZ 4096
+
+// Largest payload of a request that is not a file transfer
+#define REQUEST_MAX 64
+
+// Capabilities the server agrees to in the OP_HELLO handshake
+#define SERVER_CAPABILITIES (CAP_COMPRESS | CAP_CHECKSUM)
+
+// Room for "<name>.<transfer id>.part"
+#define PART_NAME_SIZE (MAX_NAME_LENGTH + 18 + sizeof(PART_SUFFIX))
+
+// Ledger of the ranges received by a multi-stream transfer, next to its part
+// file, with one offset(64) length(64) total(64) record per range
+#define LEDGER_SUFFIX ".ledger"
+#define LEDGER_RECORD_SIZE 24
+#define LEDGER_MAX_RECORDS 4096
+
+// Part files and ledgers of transfers left untouched for this many seconds
+// are removed, checked at most every PART_SWEEP_INTERVAL seconds
+#define PART_EXPIRY (60 * 60)
+#define PART_SWEEP_INTERVAL 60
+
+// Payloads at least this large are moved to disk with splice
+#define SPLICE_MIN (64 * 1024)
+
+// Work a connection waits for the disk threads to do for its request
+enum ConnectionTask
+{
+    TASK_NONE,
+    TASK_LOOKUP,
+    TASK_SIGNATURE
+};
+
+// Parsing state of a client connection
+enum ConnectionState
+{
+    STATE_HEADER,
+    STATE_NAME,
+    STATE_REQUEST,
+    STATE_PAYLOAD,
+    STATE_DELTA,
+    STATE_COMPRESSED,
+    STATE_BUNDLE,
+    STATE_WRITING,
+    STATE_SENDING,
+    STATE_CLOSING
+};
+
+/*
+ * Buffers of one worker, recycled from connection to connection instead of
+ * being allocated and cleared for each one
+ */
+struct ConnectionPool
+{
+    struct Slab contexts;
+    struct Slab outputs;
+    struct Slab chunks;
+    struct Slab bundles;
+};
+
+/*
+ * Per-client state. Bytes are fed in whatever pieces the socket returns;
+ * partially received headers and names are accumulated here so nothing is
+ * parsed twice. The fields used for every received byte come first, on the
+ * first cache lines. connectionCreate only clears the fields before the
+ * scratch buffers.
+ */
+struct Connection
+{
+    int socket;
+    enum ConnectionState state;
+    size_t headerLength;
+    struct FrameHeader header;
+    size_t nameLength;
+    size_t requestLength;
+    size_t requestExpected;
+    uint64_t remaining;
+
+    int file;
+    int partial;
+    int validName;
+    int overwrite;
+    int writeFailed;
+    int noSplice;
+    int checked;
+    int writeBehind;
+    int nameRejected;
+    size_t extensionStart;
+    struct WorkerStats *stats;
+
+    char *out;
+    size_t outLength;
+    size_t outSent;
+    size_t outCapacity;
+
+    struct DeltaDecoder delta;
+    struct ChunkDecoder decoder;
+    uint32_t checkCrc;
+    uint32_t checkChunk;
+    uint32_t checkLeft;
+    size_t trailerLength;
+    unsigned char trailer[CHECKSUM_SIZE];
+    int corrupt;
+    uint64_t checkOffset;
+    uint32_t capabilities;
+    uint64_t resumeOffset;
+    int resumable;
+    uint64_t transferId;
+    uint64_t rangeOffset;
+    uint64_t rangeTotal;
+
+    char (*pending)[MAX_NAME_LENGTH + 1];
+    size_t pendingLength;
+    size_t pendingCapacity;
+
+    int sendFile;
+    uint64_t sendOffset;
+    uint64_t sendRemaining;
+    struct FileCache *cache;
+    struct CachedFile *sendCached;
+    uint64_t transferStart;
+
+    struct DiskQueue *disk;
+    struct DiskFile diskFile;
+    struct DiskBuffer *diskBuffer;
+    uint64_t diskOffset;
+    enum ConnectionTask task;
+    enum Status taskStatus;
+    unsigned char *taskData;
+    size_t taskLength;
+    char *held;
+    size_t heldLength;
+
+    int batching;
+    int bundleReply;
+    char *bundle;
+    size_t bundleLength;
+    uint32_t *batch;
+    size_t batchLength;
+    size_t batchCapacity;
+
+    // Set by the event loop when the connection is destroyed at the end of
+    // the current batch of events
+    int closed;
+    struct Connection *nextClosed;
+
+    struct ConnectionPool *pool;
+
+    // Scratch buffers, written before being read, so a recycled context
+    // keeps whatever the previous connection left in them
+    unsigned char headerBytes[FRAME_HEADER_SIZE];
+    unsigned char request[REQUEST_MAX];
+    char fileName[MAX_NAME_LENGTH + 1];
+    char partName[PART_NAME_SIZE];
+    char resumeName[MAX_NAME_LENGTH + 1];
+    char address[ADDRSTRSZ];
+} __attribute__((aligned(CACHE_LINE)));
+
+void connectionPoolInit(struct ConnectionPool *pool);
+
+struct Connection *connectionCreate(struct ConnectionPool *pool, int socket,
+                                    const struct sockaddr *addr, struct WorkerStats *stats);
+
+void connectionDestroy(struct Connection *conn);
+
+int connectionFeed(struct Connection *conn, const char *data, size_t length);
+
+int connectionPayloadWritten(struct Connection *conn, size_t length);
+
+int connectionCanSplice(const struct Connection *conn);
+
+int connectionSplice(struct Connection *conn, const int pipeFds[2]);
+
+size_t connectionPendingOutput(const struct Connection *conn);
+
+int connectionFlush(struct Connection *conn);
+
+int connectionWantsInput(const struct Connection *conn);
+
+int connectionFillOutput(struct Connection *conn);
+
+int connectionDiskReady(struct Connection *conn);
+
+#endif
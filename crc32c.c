@@ -0,0 +1,286 @@
+#include "crc32c.h"
+
+#include <endian.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Castagnoli polynomial, bit-reflected
+#define CRC32C_POLY 0x82f63b78u
+
+// Bytes of the three streams checksummed side by side by the instruction
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+static int hardware;
+
+// Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zeros
+static uint32_t table[8][256];
+
+// Operators appending CRC32C_LONG or CRC32C_SHORT zero bytes to a CRC,
+// applied a byte of the CRC at a time
+static uint32_t zerosLong[4][256];
+static uint32_t zerosShort[4][256];
+
+/*
+ * Multiply a 32x32 matrix over GF(2) by a vector.
+ */
+static uint32_t gf2Times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, matrix++)
+    {
+        if (vector & 1)
+        {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void gf2Square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; n++)
+    {
+        square[n] = gf2Times(matrix, matrix[n]);
+    }
+}
+
+/*
+ * Build the tables appending `length` zero bytes, a power of two, to a CRC,
+ * by squaring the operator for one zero bit until it covers them.
+ */
+static void buildZeros(uint32_t zeros[4][256], size_t length)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2Square(even, odd);
+    gf2Square(odd, even);
+
+    // Every square doubles the zeros, starting from one byte
+    uint32_t *op = odd;
+    do
+    {
+        gf2Square(even, odd);
+        op = even;
+        length >>= 1;
+        if (length == 0)
+        {
+            break;
+        }
+        gf2Square(odd, even);
+        op = odd;
+        length >>= 1;
+    } while (length != 0);
+
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        zeros[0][n] = gf2Times(op, n);
+        zeros[1][n] = gf2Times(op, n << 8);
+        zeros[2][n] = gf2Times(op, n << 16);
+        zeros[3][n] = gf2Times(op, n << 24);
+    }
+}
+
+static void crc32cInit(void)
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+        }
+    }
+
+#if defined(__x86_64__)
+    hardware = __builtin_cpu_supports("sse4.2");
+#endif
+    if (hardware)
+    {
+        buildZeros(zerosLong, CRC32C_LONG);
+        buildZeros(zerosShort, CRC32C_SHORT);
+    }
+}
+
+/*
+ * Slicing-by-8: fold eight bytes per step through eight tables, copying
+ * them to `dst` on the way unless it is NULL.
+ */
+static inline __attribute__((always_inline)) uint32_t
+softwareCrc(uint32_t crc, unsigned char *dst, const unsigned char *src, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        if (dst != NULL)
+        {
+            memcpy(dst, &word, 8);
+            dst += 8;
+        }
+        word = le64toh(word) ^ crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+              table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+              table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        src += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        if (dst != NULL)
+        {
+            *dst++ = *src;
+        }
+        crc = table[0][(crc ^ *src++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+static inline uint32_t shift(const uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^
+           zeros[3][crc >> 24];
+}
+
+/*
+ * Run the crc32 instruction over three blocks of `block` bytes at once,
+ * copying them to `dst` unless it is NULL. The instruction has a latency of
+ * three cycles but a throughput of one, so three independent streams keep
+ * it busy; their CRCs are then combined by appending zeros to the first two.
+ */
+static inline __attribute__((always_inline, target("sse4.2"))) uint64_t
+hardwareBlocks(uint64_t crc0, unsigned char **dst, const unsigned char **src, size_t *length,
+               size_t block, const uint32_t zeros[4][256])
+{
+    while (*length >= 3 * block)
+    {
+        const unsigned char *next = *src;
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        for (size_t i = 0; i < block; i += 8)
+        {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, next + i, 8);
+            memcpy(&word1, next + block + i, 8);
+            memcpy(&word2, next + 2 * block + i, 8);
+            if (*dst != NULL)
+            {
+                memcpy(*dst + i, &word0, 8);
+                memcpy(*dst + block + i, &word1, 8);
+                memcpy(*dst + 2 * block + i, &word2, 8);
+            }
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+        }
+        crc0 = shift(zeros, crc0) ^ crc1;
+        crc0 = shift(zeros, crc0) ^ crc2;
+
+        *src += 3 * block;
+        if (*dst != NULL)
+        {
+            *dst += 3 * block;
+        }
+        *length -= 3 * block;
+    }
+    return crc0;
+}
+
+static inline __attribute__((always_inline, target("sse4.2"))) uint32_t
+hardwareCrc(uint32_t crc, unsigned char *dst, const unsigned char *src, size_t length)
+{
+    uint64_t crc0 = crc;
+    crc0 = hardwareBlocks(crc0, &dst, &src, &length, CRC32C_LONG, zerosLong);
+    crc0 = hardwareBlocks(crc0, &dst, &src, &length, CRC32C_SHORT, zerosShort);
+
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        if (dst != NULL)
+        {
+            memcpy(dst, &word, 8);
+            dst += 8;
+        }
+        crc0 = _mm_crc32_u64(crc0, word);
+        src += 8;
+        length -= 8;
+    }
+    crc = crc0;
+    while (length-- > 0)
+    {
+        if (dst != NULL)
+        {
+            *dst++ = *src;
+        }
+        crc = _mm_crc32_u8(crc, *src++);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t hardwareUpdate(uint32_t crc, const void *data,
+                                                                  size_t length)
+{
+    return hardwareCrc(crc, NULL, data, length);
+}
+
+__attribute__((target("sse4.2"))) static uint32_t hardwareCopy(uint32_t crc, void *dst,
+                                                                const void *src, size_t length)
+{
+    return hardwareCrc(crc, dst, src, length);
+}
+
+#endif
+
+/*
+ * Extend the CRC32C `crc` of the bytes before with `length` bytes of data.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&initOnce, crc32cInit);
+#if defined(__x86_64__)
+    if (hardware)
+    {
+        return ~hardwareUpdate(~crc, data, length);
+    }
+#endif
+    return ~softwareCrc(~crc, NULL, data, length);
+}
+
+/*
+ * Copy `length` bytes from `src` to `dst` and extend the CRC32C `crc` with
+ * them in the same pass, so the data is only loaded once.
+ */
+uint32_t crc32cCopy(uint32_t crc, void *dst, const void *src, size_t length)
+{
+    pthread_once(&initOnce, crc32cInit);
+#if defined(__x86_64__)
+    if (hardware)
+    {
+        return ~hardwareCopy(~crc, dst, src, length);
+    }
+#endif
+    return ~softwareCrc(~crc, dst, src, length);
+}
@@ -0,0 +1,18 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI and SCTP. A checksum is computed
+ * incrementally by passing the previous result back in, starting from 0.
+ * The SSE4.2 crc32 instruction is used when the processor has it, with a
+ * slicing-by-8 table lookup otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+uint32_t crc32cCopy(uint32_t crc, void *dst, const void *src, size_t length);
+
+#endif
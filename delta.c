@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+
+#include "delta.h"
+#include "protocol.h"
+#include "sha256.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Choose the block size for a file: about the square root of its length,
+ * which balances the size of the signatures against the literal bytes a
+ * change costs.
+ */
+uint32_t deltaBlockSize(uint64_t length)
+{
+    uint32_t size = DELTA_BLOCK_MIN;
+    while (size < DELTA_BLOCK_MAX && (uint64_t)size * size < length)
+    {
+        size *= 2;
+    }
+    return size;
+}
+
+/*
+ * Weak checksum of a block, as in rsync: two 16-bit sums that can be rolled
+ * one byte forward without rereading the block.
+ */
+static void weakSums(const unsigned char *data, size_t length, uint32_t *a, uint32_t *b)
+{
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        s1 += data[i];
+        s2 += (uint32_t)(length - i) * data[i];
+    }
+    *a = s1 & 0xffff;
+    *b = s2 & 0xffff;
+}
+
+static void strongSum(const unsigned char *data, size_t length, unsigned char *out)
+{
+    unsigned char digest[SHA256_SIZE];
+    struct Sha256 ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, data, length);
+    sha256Final(&ctx, digest);
+    memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+/*
+ * Compute the signature of every block of the old copy.
+ * - data and length are the old copy
+ * - out receives DELTA_SIGNATURE_SIZE bytes per block
+ */
+void deltaSignatures(const unsigned char *data, uint64_t length, uint32_t blockSize,
+                     unsigned char *out)
+{
+    for (uint64_t offset = 0; offset < length; offset += blockSize)
+    {
+        size_t block = length - offset < blockSize ? (size_t)(length - offset) : blockSize;
+        uint32_t a, b;
+        weakSums(data + offset, block, &a, &b);
+        uint32_t weak = htobe32(a | b << 16);
+        memcpy(out, &weak, 4);
+        strongSum(data + offset, block, out + 4);
+        out += DELTA_SIGNATURE_SIZE;
+    }
+}
+
+/*
+ * Instructions being written by deltaEncode. Consecutive block copies are
+ * merged into one instruction.
+ */
+struct DeltaWriter
+{
+    FILE *out;
+    uint32_t copyFirst;
+    uint32_t copyCount;
+};
+
+static int writeOp(FILE *out, uint8_t op, uint32_t first, uint32_t second)
+{
+    unsigned char raw[DELTA_OP_SIZE];
+    uint32_t value = htobe32(first);
+    raw[0] = op;
+    memcpy(raw + 1, &value, 4);
+    value = htobe32(second);
+    memcpy(raw + 5, &value, 4);
+    return fwrite(raw, 1, DELTA_OP_SIZE, out) == DELTA_OP_SIZE ? 0 : -1;
+}
+
+static int flushCopy(struct DeltaWriter *writer)
+{
+    if (writer->copyCount == 0)
+    {
+        return 0;
+    }
+    int result = writeOp(writer->out, DELTA_COPY, writer->copyFirst, writer->copyCount);
+    writer->copyCount = 0;
+    return result;
+}
+
+static int emitLiteral(struct DeltaWriter *writer, const unsigned char *data, uint64_t length)
+{
+    if (length > 0 && flushCopy(writer) != 0)
+    {
+        return -1;
+    }
+    while (length > 0)
+    {
+        uint32_t run = length < (1u << 30) ? (uint32_t)length : (1u << 30);
+        if (writeOp(writer->out, DELTA_LITERAL, run, 0) != 0 ||
+            fwrite(data, 1, run, writer->out) != run)
+        {
+            return -1;
+        }
+        data += run;
+        length -= run;
+    }
+    return 0;
+}
+
+static int emitCopy(struct DeltaWriter *writer, uint32_t block)
+{
+    if (writer->copyCount > 0 && block == writer->copyFirst + writer->copyCount)
+    {
+        writer->copyCount++;
+        return 0;
+    }
+    if (flushCopy(writer) != 0)
+    {
+        return -1;
+    }
+    writer->copyFirst = block;
+    writer->copyCount = 1;
+    return 0;
+}
+
+/*
+ * Encode the new content as literal runs and references to the blocks of
+ * the old copy whose signatures the server sent.
+ * - data and length are the new content
+ * - signatures, blockSize and basisLength describe the old copy
+ * - out receives the delta, header included
+ * Returns 0 on success, -1 on failure.
+ */
+int deltaEncode(const unsigned char *data, uint64_t length, const unsigned char *signatures,
+                uint32_t blockSize, uint64_t basisLength, FILE *out)
+{
+    uint32_t count = (basisLength + blockSize - 1) / blockSize;
+    size_t lastLength = basisLength - (uint64_t)(count - 1) * blockSize;
+
+    // Chained hash table of the blocks by weak checksum
+    size_t tableSize = 1;
+    while (tableSize < 2 * (size_t)count)
+    {
+        tableSize *= 2;
+    }
+    int32_t *heads = malloc(tableSize * sizeof(int32_t));
+    int32_t *next = malloc(count * sizeof(int32_t));
+    uint32_t *weaks = malloc(count * sizeof(uint32_t));
+    if (heads == NULL || next == NULL || weaks == NULL)
+    {
+        free(heads);
+        free(next);
+        free(weaks);
+        return -1;
+    }
+    memset(heads, -1, tableSize * sizeof(int32_t));
+    for (uint32_t i = count; i-- > 0;)
+    {
+        memcpy(&weaks[i], signatures + (size_t)i * DELTA_SIGNATURE_SIZE, 4);
+        weaks[i] = be32toh(weaks[i]);
+        size_t slot = (weaks[i] * 2654435761u) & (tableSize - 1);
+        next[i] = heads[slot];
+        heads[slot] = i;
+    }
+
+    unsigned char header[DELTA_HEADER_SIZE];
+    uint32_t wireBlock = htobe32(blockSize);
+    uint64_t wireLength = htobe64(basisLength);
+    memcpy(header, &wireBlock, 4);
+    memcpy(header + 4, &wireLength, 8);
+
+    struct DeltaWriter writer = {out, 0, 0};
+    int result = fwrite(header, 1, DELTA_HEADER_SIZE, out) == DELTA_HEADER_SIZE ? 0 : -1;
+
+    uint64_t position = 0, literalStart = 0;
+    uint32_t a = 0, b = 0;
+    int valid = 0;
+    while (result == 0 && position < length)
+    {
+        size_t window = length - position < blockSize ? (size_t)(length - position) : blockSize;
+        if (!valid)
+        {
+            weakSums(data + position, window, &a, &b);
+            valid = 1;
+        }
+
+        uint32_t weak = a | b << 16;
+        int32_t match = -1;
+        unsigned char strong[DELTA_STRONG_SIZE];
+        int strongDone = 0;
+        for (int32_t i = heads[(weak * 2654435761u) & (tableSize - 1)]; i != -1; i = next[i])
+        {
+            size_t blockLength = (uint32_t)i == count - 1 ? lastLength : blockSize;
+            if (weaks[i] != weak || blockLength != window)
+            {
+                continue;
+            }
+            if (!strongDone)
+            {
+                strongSum(data + position, window, strong);
+                strongDone = 1;
+            }
+            if (memcmp(strong, signatures + (size_t)i * DELTA_SIGNATURE_SIZE + 4, DELTA_STRONG_SIZE) == 0)
+            {
+                match = i;
+                break;
+            }
+        }
+
+        if (match != -1)
+        {
+            result = emitLiteral(&writer, data + literalStart, position - literalStart);
+            if (result == 0)
+            {
+                result = emitCopy(&writer, match);
+            }
+            position += window;
+            literalStart = position;
+            valid = 0;
+        }
+        else if (position + blockSize < length)
+        {
+            // Roll the window one byte forward
+            uint32_t leaving = data[position], entering = data[position + blockSize];
+            a = (a - leaving + entering) & 0xffff;
+            b = (b - blockSize * leaving + a) & 0xffff;
+            position++;
+        }
+        else if (lastLength < blockSize && length - lastLength > position)
+        {
+            // Only the short last block can still match, at the very end
+            position = length - lastLength;
+            valid = 0;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (result == 0)
+    {
+        result = emitLiteral(&writer, data + literalStart, length - literalStart);
+    }
+    if (result == 0)
+    {
+        result = flushCopy(&writer);
+    }
+    free(heads);
+    free(next);
+    free(weaks);
+    return result;
+}
+
+/*
+ * Append a range of the old copy to the new file, inside the kernel when
+ * the file system allows it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int copyRange(int basis, int out, off_t offset, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = copy_file_range(basis, &offset, out, NULL, length, 0);
+        if (count > 0)
+        {
+            length -= count;
+            continue;
+        }
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP))
+            return -1;
+        break;
+    }
+
+    static char chunk[CHUNKSZ];
+    while (length > 0)
+    {
+        ssize_t count = pread(basis, chunk, length < CHUNKSZ ? length : CHUNKSZ, offset);
+        if (count <= 0 || writeAll(out, chunk, count) != 0)
+            return -1;
+        offset += count;
+        length -= count;
+    }
+    return 0;
+}
+
+/*
+ * Start rebuilding a file.
+ * - basis is the old copy, opened for reading
+ * - out is the new file, opened for writing
+ */
+void deltaDecoderInit(struct DeltaDecoder *decoder, int basis, int out)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->basis = basis;
+    decoder->out = out;
+}
+
+/*
+ * Apply the next piece of the delta.
+ * Returns 0 on success, -1 if the delta is invalid or the new file could not
+ * be written.
+ */
+int deltaDecoderFeed(struct DeltaDecoder *decoder, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        if (decoder->literal > 0)
+        {
+            size_t taken = decoder->literal < length ? decoder->literal : length;
+            if (writeAll(decoder->out, data, taken) != 0)
+            {
+                return -1;
+            }
+            decoder->literal -= taken;
+            data += taken;
+            length -= taken;
+            continue;
+        }
+
+        size_t wanted = decoder->started ? DELTA_OP_SIZE : DELTA_HEADER_SIZE;
+        size_t taken = wanted - decoder->pendingLength < length ? wanted - decoder->pendingLength : length;
+        memcpy(decoder->pending + decoder->pendingLength, data, taken);
+        decoder->pendingLength += taken;
+        data += taken;
+        length -= taken;
+        if (decoder->pendingLength < wanted)
+        {
+            break;
+        }
+        decoder->pendingLength = 0;
+
+        if (!decoder->started)
+        {
+            uint32_t blockSize;
+            uint64_t basisLength;
+            struct stat st;
+            memcpy(&blockSize, decoder->pending, 4);
+            memcpy(&basisLength, decoder->pending + 4, 8);
+            decoder->blockSize = be32toh(blockSize);
+            decoder->basisLength = be64toh(basisLength);
+            if (decoder->blockSize < DELTA_BLOCK_MIN || decoder->blockSize > DELTA_BLOCK_MAX ||
+                fstat(decoder->basis, &st) != 0 || (uint64_t)st.st_size != decoder->basisLength)
+            {
+                return -1;
+            }
+            decoder->started = 1;
+            continue;
+        }
+
+        uint32_t first, second;
+        memcpy(&first, decoder->pending + 1, 4);
+        memcpy(&second, decoder->pending + 5, 4);
+        first = be32toh(first);
+        second = be32toh(second);
+
+        if (decoder->pending[0] == DELTA_LITERAL)
+        {
+            decoder->literal = first;
+            continue;
+        }
+
+        uint64_t blocks = (decoder->basisLength + decoder->blockSize - 1) / decoder->blockSize;
+        uint64_t offset = (uint64_t)first * decoder->blockSize;
+        uint64_t end = offset + (uint64_t)second * decoder->blockSize;
+        end = end < decoder->basisLength ? end : decoder->basisLength;
+        if (decoder->pending[0] != DELTA_COPY || second == 0 || (uint64_t)first + second > blocks ||
+            copyRange(decoder->basis, decoder->out, offset, end - offset) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Check that the delta ended on an instruction boundary.
+ */
+int deltaDecoderDone(const struct DeltaDecoder *decoder)
+{
+    return decoder->started && decoder->literal == 0 && decoder->pendingLength == 0;
+}
@@ -0,0 +1,65 @@
+#ifndef DELTA_H
+#define DELTA_H
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Delta transfer of a file the server already has an older copy of.
+ *
+ * Signatures of the old copy, sent by the server: blockSize(32) length(64),
+ * then for every block weak(32) and the first DELTA_STRONG_SIZE bytes of its
+ * SHA-256. The last block may be shorter than blockSize.
+ *
+ * Delta, sent by the client: the same blockSize(32) length(64) as a check
+ * that the old copy did not change, then instructions of DELTA_OP_SIZE bytes:
+ *   DELTA_LITERAL length(32) 0(32), followed by `length` new bytes
+ *   DELTA_COPY first(32) count(32), copying `count` blocks of the old copy
+ */
+#define DELTA_HEADER_SIZE 12
+#define DELTA_STRONG_SIZE 16
+#define DELTA_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_OP_SIZE 9
+
+#define DELTA_BLOCK_MIN 1024
+#define DELTA_BLOCK_MAX (128 * 1024)
+
+enum DeltaOp
+{
+    DELTA_LITERAL = 0,
+    DELTA_COPY = 1
+};
+
+/*
+ * Server side state rebuilding a file from the old copy and a delta that
+ * arrives in arbitrary pieces.
+ */
+struct DeltaDecoder
+{
+    int basis;
+    int out;
+    uint32_t blockSize;
+    uint64_t basisLength;
+
+    unsigned char pending[DELTA_HEADER_SIZE];
+    size_t pendingLength;
+    int started;
+    uint32_t literal;
+};
+
+uint32_t deltaBlockSize(uint64_t length);
+
+void deltaSignatures(const unsigned char *data, uint64_t length, uint32_t blockSize,
+                     unsigned char *out);
+
+int deltaEncode(const unsigned char *data, uint64_t length, const unsigned char *signatures,
+                uint32_t blockSize, uint64_t basisLength, FILE *out);
+
+void deltaDecoderInit(struct DeltaDecoder *decoder, int basis, int out);
+
+int deltaDecoderFeed(struct DeltaDecoder *decoder, const char *data, size_t length);
+
+int deltaDecoderDone(const struct DeltaDecoder *decoder);
+
+#endif
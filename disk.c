@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+
+#include "disk.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static int queueDepth;
+static enum SyncPolicy syncPolicy;
+static int directoryFd = -1;
+
+/*
+ * Read a fsync policy given on the command line: "none", "file" or "group".
+ * Returns 0 on success, -1 if the name is unknown.
+ */
+int diskParsePolicy(const char *name, enum SyncPolicy *policy)
+{
+    static const char *names[] = {"none", "file", "group"};
+    for (int i = 0; i < 3; i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            *policy = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Set the number of pooled buffers of every worker, 0 to write payloads
+ * from the event loop, and the fsync policy of received files. Called once,
+ * before the workers start, in the directory files are received in.
+ */
+void diskConfigure(int depth, enum SyncPolicy policy)
+{
+    queueDepth = depth;
+    syncPolicy = policy;
+    if (policy != SYNC_NONE)
+    {
+        directoryFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+}
+
+enum SyncPolicy diskSyncPolicy(void)
+{
+    return syncPolicy;
+}
+
+/*
+ * Make the names created or renamed in the receiving directory durable.
+ * Returns 0 on success, -1 on failure.
+ */
+int diskSyncDirectory(void)
+{
+    return directoryFd != -1 && fsync(directoryFd) == 0 ? 0 : -1;
+}
+
+/*
+ * Make everything written to the file system of the receiving directory
+ * durable at once, for a group commit.
+ * Returns 0 on success, -1 on failure.
+ */
+int diskSyncAll(void)
+{
+    return directoryFd != -1 && syncfs(directoryFd) == 0 ? 0 : -1;
+}
+
+/*
+ * Wake the event loop through the eventfd.
+ */
+static void notify(struct DiskQueue *q)
+{
+    uint64_t one = 1;
+    if (write(q->eventFd, &one, sizeof(one)) != sizeof(one))
+    {
+        // The counter is already set, the event loop will wake up anyway
+    }
+}
+
+/*
+ * Hand a finished file back to the event loop. Called with the lock held.
+ */
+static void completeLocked(struct DiskQueue *q, struct DiskFile *file)
+{
+    file->next = q->completed;
+    q->completed = file;
+    notify(q);
+}
+
+/*
+ * Make a file whose writes are all done durable according to the policy,
+ * or complete it right away. Called with the lock held.
+ */
+static void finishLocked(struct DiskQueue *q, struct DiskFile *file)
+{
+    if (syncPolicy == SYNC_NONE)
+    {
+        completeLocked(q, file);
+        return;
+    }
+    file->pending++;
+    file->next = q->syncs;
+    q->syncs = file;
+    pthread_cond_signal(&q->work);
+}
+
+/*
+ * Put a buffer back in the pool, waking the event loop if a connection is
+ * waiting for one. Called with the lock held.
+ */
+static void releaseLocked(struct DiskQueue *q, struct DiskBuffer *buffer)
+{
+    buffer->next = q->free;
+    q->free = buffer;
+    if (q->waiters != NULL)
+    {
+        notify(q);
+    }
+}
+
+/*
+ * Drop one pending operation of a file, finishing it after the last one.
+ * Called with the lock held.
+ */
+static void dropPending(struct DiskQueue *q, struct DiskFile *file)
+{
+    if (--file->pending == 0)
+    {
+        pthread_cond_broadcast(&q->drained);
+        if (file->finishing)
+        {
+            finishLocked(q, file);
+        }
+    }
+}
+
+static int pwriteAll(int fd, const char *buf, size_t length, uint64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t count = pwrite(fd, buf, length, offset);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return -1;
+        buf += count;
+        length -= count;
+        offset += count;
+    }
+    return 0;
+}
+
+/*
+ * Sync the files waiting for it: one fdatasync per file, or with a group
+ * commit a single syncfs for every file that finished while the previous
+ * group was being synced. The durable files are then renamed into place,
+ * and one fsync of the directory makes the renames of the whole group
+ * durable. Called with the lock held, released meanwhile.
+ */
+static void syncFiles(struct DiskQueue *q)
+{
+    struct DiskFile *group = q->syncs;
+    if (syncPolicy == SYNC_GROUP)
+    {
+        q->syncs = NULL;
+        q->syncing = 1;
+    }
+    else
+    {
+        q->syncs = group->next;
+        group->next = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    int failed = (syncPolicy == SYNC_GROUP ? syncfs(group->fd) : fdatasync(group->fd)) != 0;
+
+    // Writes are over, so the failed flags are stable without the lock
+    int renamed = 0;
+    for (struct DiskFile *file = group; file != NULL && !failed; file = file->next)
+    {
+        if (file->from != NULL && !file->failed)
+        {
+            file->renamed = rename(file->from, file->to) == 0;
+            file->failed = !file->renamed;
+            renamed |= file->renamed;
+        }
+    }
+    if (renamed && diskSyncDirectory() != 0)
+    {
+        failed = 1;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->syncing = 0;
+    while (group != NULL)
+    {
+        struct DiskFile *next = group->next;
+        group->failed |= failed;
+        group->pending--;
+        pthread_cond_broadcast(&q->drained);
+        completeLocked(q, group);
+        group = next;
+    }
+}
+
+/*
+ * Run the oldest queued task. A task without an owner is released by the
+ * task itself; the others are handed back to the event loop. Called with
+ * the lock held, released meanwhile.
+ */
+static void runTask(struct DiskQueue *q)
+{
+    struct DiskFile *file = q->tasks;
+    q->tasks = file->next;
+    pthread_mutex_unlock(&q->lock);
+
+    int owned = file->owner != NULL;
+    file->task(file);
+
+    pthread_mutex_lock(&q->lock);
+    if (owned)
+    {
+        file->pending--;
+        pthread_cond_broadcast(&q->drained);
+        completeLocked(q, file);
+    }
+}
+
+/*
+ * Disk thread: write queued buffers at their offsets, run the queued tasks,
+ * then sync the files whose writes are done.
+ */
+static void *diskThread(void *arg)
+{
+    struct DiskQueue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    while (1)
+    {
+        if (q->jobs != NULL)
+        {
+            struct DiskBuffer *job = q->jobs;
+            q->jobs = job->next;
+            __atomic_store_n(&q->stats->diskQueued, --q->queued, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&q->lock);
+
+            int failed = pwriteAll(job->file->fd, job->data, job->length, job->offset) != 0;
+
+            pthread_mutex_lock(&q->lock);
+            struct DiskFile *file = job->file;
+            file->failed |= failed;
+            releaseLocked(q, job);
+            dropPending(q, file);
+        }
+        else if (q->tasks != NULL)
+        {
+            runTask(q);
+        }
+        else if (q->syncs != NULL && !q->syncing)
+        {
+            syncFiles(q);
+        }
+        else
+        {
+            pthread_cond_wait(&q->work, &q->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Allocate the buffer pool of the calling worker, empty when payloads are
+ * written from the event loop, and start its disk threads, reporting the
+ * writes waiting for them in `stats`.
+ * Returns NULL on failure.
+ */
+struct DiskQueue *diskQueueCreate(struct WorkerStats *stats)
+{
+    struct DiskQueue *q = calloc(1, sizeof(*q));
+    if (q == NULL)
+    {
+        return NULL;
+    }
+    q->depth = queueDepth;
+    if (queueDepth > 0)
+    {
+        q->buffers = calloc(queueDepth, sizeof(struct DiskBuffer));
+        q->memory = aligned_alloc(4096, (size_t)queueDepth * DISK_BUFSZ);
+    }
+    q->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((queueDepth > 0 && (q->buffers == NULL || q->memory == NULL)) || q->eventFd == -1)
+    {
+        if (q->eventFd != -1)
+            close(q->eventFd);
+        free(q->buffers);
+        free(q->memory);
+        free(q);
+        return NULL;
+    }
+
+    for (int i = 0; i < queueDepth; i++)
+    {
+        q->buffers[i].data = q->memory + (size_t)i * DISK_BUFSZ;
+        q->buffers[i].next = q->free;
+        q->free = &q->buffers[i];
+    }
+    q->stats = stats;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->drained, NULL);
+
+    for (int i = 0; i < DISK_THREADS; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, diskThread, q) != 0)
+        {
+            // Threads already started keep the queue alive
+            return i > 0 ? q : NULL;
+        }
+        pthread_detach(thread);
+    }
+    return q;
+}
+
+/*
+ * Prepare a file whose payload is about to be queued.
+ */
+void diskFileInit(struct DiskFile *file, void *owner, int fd)
+{
+    memset(file, 0, sizeof(*file));
+    file->owner = owner;
+    file->fd = fd;
+}
+
+/*
+ * Take an empty buffer from the pool for the file. When the pool is empty
+ * the file is handed back by diskReap once a buffer was released.
+ * Returns the buffer, or NULL if none is free.
+ */
+struct DiskBuffer *diskBuffer(struct DiskQueue *q, struct DiskFile *file)
+{
+    pthread_mutex_lock(&q->lock);
+    struct DiskBuffer *buffer = q->free;
+    if (buffer != NULL)
+    {
+        q->free = buffer->next;
+        buffer->file = file;
+        buffer->length = 0;
+    }
+    else if (!file->waiting)
+    {
+        file->waiting = 1;
+        file->next = q->waiters;
+        q->waiters = file;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return buffer;
+}
+
+/*
+ * Queue a filled buffer to be written by a disk thread. The buffer goes back
+ * to the pool once written, right away if it is empty.
+ */
+void diskWrite(struct DiskQueue *q, struct DiskBuffer *buffer)
+{
+    pthread_mutex_lock(&q->lock);
+    if (buffer->length == 0)
+    {
+        releaseLocked(q, buffer);
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+
+    buffer->file->pending++;
+    buffer->next = NULL;
+    if (q->jobs == NULL)
+        q->jobs = buffer;
+    else
+        q->jobsTail->next = buffer;
+    q->jobsTail = buffer;
+    __atomic_store_n(&q->stats->diskQueued, ++q->queued, __ATOMIC_RELAXED);
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Mark the whole payload of a file as queued. Once its writes are done, and
+ * it is synced if the policy asks for it, diskReap hands it back as done.
+ */
+void diskFinish(struct DiskQueue *q, struct DiskFile *file)
+{
+    pthread_mutex_lock(&q->lock);
+    file->finishing = 1;
+    if (file->pending == 0)
+    {
+        finishLocked(q, file);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void unlinkFile(struct DiskFile **list, struct DiskFile *file)
+{
+    for (; *list != NULL; list = &(*list)->next)
+    {
+        if (*list == file)
+        {
+            *list = file->next;
+            return;
+        }
+    }
+}
+
+/*
+ * Queue a task to be run by a disk thread. Once it ran, diskReap hands the
+ * file back as done, unless it has no owner: such a task runs on its own
+ * and releases the file itself.
+ */
+void diskRun(struct DiskQueue *q, struct DiskFile *file, void (*task)(struct DiskFile *file))
+{
+    pthread_mutex_lock(&q->lock);
+    file->task = task;
+    file->next = NULL;
+    if (file->owner != NULL)
+    {
+        file->pending++;
+    }
+    if (q->tasks == NULL)
+        q->tasks = file;
+    else
+        q->tasksTail->next = file;
+    q->tasksTail = file;
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Wait until no disk thread uses the file any more and forget it, so its
+ * owner can be released.
+ */
+void diskCancel(struct DiskQueue *q, struct DiskFile *file)
+{
+    pthread_mutex_lock(&q->lock);
+    while (file->pending > 0)
+    {
+        pthread_cond_wait(&q->drained, &q->lock);
+    }
+    unlinkFile(&q->completed, file);
+    unlinkFile(&q->waiters, file);
+    file->waiting = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Collect the files handed back to the event loop: those that are done,
+ * marked with `done`, and those that waited for a buffer when one is free.
+ * Returns them as a list linked by `next`.
+ */
+struct DiskFile *diskReap(struct DiskQueue *q)
+{
+    uint64_t count;
+    if (read(q->eventFd, &count, sizeof(count)) != sizeof(count))
+    {
+        // Nothing was signalled since the last call
+    }
+
+    pthread_mutex_lock(&q->lock);
+    struct DiskFile *ready = q->completed;
+    q->completed = NULL;
+    for (struct DiskFile *file = ready; file != NULL; file = file->next)
+    {
+        file->done = 1;
+    }
+
+    if (q->free != NULL)
+    {
+        while (q->waiters != NULL)
+        {
+            struct DiskFile *file = q->waiters;
+            q->waiters = file->next;
+            file->waiting = 0;
+            file->next = ready;
+            ready = file;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ready;
+}
@@ -0,0 +1,116 @@
+#ifndef DISK_H
+#define DISK_H
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+// Threads of a worker that write queued payloads to disk and run the tasks
+// that read or hash whole files away from the event loop
+#define DISK_THREADS 4
+
+// Size of one pooled write-behind buffer, the most one pwrite moves at once
+#define DISK_BUFSZ (256 * 1024)
+
+// How received files are made durable before they are acknowledged
+enum SyncPolicy
+{
+    SYNC_NONE,
+    SYNC_FILE,
+    SYNC_GROUP
+};
+
+/*
+ * A file written through the queue, or a task run by a disk thread. It
+ * belongs to the event loop, which only reads its fields once the file is
+ * handed back by diskReap. When the policy syncs files, a file given a
+ * `from` name is renamed to `to` once its content is durable, and the
+ * rename made durable too.
+ */
+struct DiskFile
+{
+    void *owner;
+    void (*task)(struct DiskFile *file);
+    int fd;
+    int pending;
+    int finishing;
+    int done;
+    int failed;
+    int waiting;
+    const char *from;
+    const char *to;
+    int renamed;
+    struct DiskFile *next;
+};
+
+/*
+ * One pooled buffer, filled by the event loop and written at `offset`
+ */
+struct DiskBuffer
+{
+    char *data;
+    size_t length;
+    uint64_t offset;
+    struct DiskFile *file;
+    struct DiskBuffer *next;
+};
+
+/*
+ * Disk queue of one worker: a fixed pool of write-behind buffers, if any,
+ * the writes and tasks waiting for a disk thread, and the files handed back
+ * to the event loop through an eventfd.
+ */
+struct DiskQueue
+{
+    int depth;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t drained;
+    int eventFd;
+
+    struct DiskBuffer *buffers;
+    char *memory;
+    struct DiskBuffer *free;
+    struct DiskBuffer *jobs;
+    struct DiskBuffer *jobsTail;
+    struct DiskFile *tasks;
+    struct DiskFile *tasksTail;
+
+    struct DiskFile *syncs;
+    struct DiskFile *completed;
+    struct DiskFile *waiters;
+    int syncing;
+    uint64_t queued;
+    struct WorkerStats *stats;
+};
+
+int diskParsePolicy(const char *name, enum SyncPolicy *policy);
+
+void diskConfigure(int depth, enum SyncPolicy policy);
+
+enum SyncPolicy diskSyncPolicy(void);
+
+int diskSyncDirectory(void);
+
+int diskSyncAll(void);
+
+struct DiskQueue *diskQueueCreate(struct WorkerStats *stats);
+
+void diskFileInit(struct DiskFile *file, void *owner, int fd);
+
+struct DiskBuffer *diskBuffer(struct DiskQueue *q, struct DiskFile *file);
+
+void diskWrite(struct DiskQueue *q, struct DiskBuffer *buffer);
+
+void diskFinish(struct DiskQueue *q, struct DiskFile *file);
+
+void diskRun(struct DiskQueue *q, struct DiskFile *file, void (*task)(struct DiskFile *file));
+
+void diskCancel(struct DiskQueue *q, struct DiskFile *file);
+
+struct DiskFile *diskReap(struct DiskQueue *q);
+
+#endif
@@ -0,0 +1,221 @@
+#include "filecache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static size_t cacheCapacity;
+
+/*
+ * Set the bytes of hot files every worker keeps mapped, 0 to send every
+ * download from its file. Called once, before the workers start.
+ */
+void fileCacheConfigure(size_t capacity)
+{
+    cacheCapacity = capacity;
+}
+
+/*
+ * Create the cache of one worker, accounted in `stats`.
+ * Returns NULL if caching is disabled or there is no memory left.
+ */
+struct FileCache *fileCacheCreate(struct WorkerStats *stats)
+{
+    if (cacheCapacity == 0)
+    {
+        return NULL;
+    }
+    struct FileCache *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache->capacity = cacheCapacity;
+    cache->stats = stats;
+    return cache;
+}
+
+/*
+ * FNV-1a hash of a name, reduced to a bucket of the index.
+ */
+static size_t bucketOf(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++)
+    {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash % FILE_CACHE_BUCKETS;
+}
+
+static struct CachedFile *findEntry(struct FileCache *cache, const char *name)
+{
+    struct CachedFile *entry = cache->buckets[bucketOf(name)];
+    while (entry != NULL && strcmp(entry->name, name) != 0)
+    {
+        entry = entry->bucketNext;
+    }
+    return entry;
+}
+
+static void unlinkRecent(struct FileCache *cache, struct CachedFile *entry)
+{
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+static void pushRecent(struct FileCache *cache, struct CachedFile *entry)
+{
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL)
+        cache->newest->newer = entry;
+    else
+        cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void destroyEntry(struct FileCache *cache, struct CachedFile *entry)
+{
+    munmap((void *)entry->data, entry->size);
+    cache->used -= entry->size;
+    free(entry);
+}
+
+/*
+ * Remove an entry from the index and the recency list. Its mapping stays
+ * accounted until the last download sending from it releases it.
+ */
+static void evictEntry(struct FileCache *cache, struct CachedFile *entry)
+{
+    struct CachedFile **link = &cache->buckets[bucketOf(entry->name)];
+    while (*link != entry)
+    {
+        link = &(*link)->bucketNext;
+    }
+    *link = entry->bucketNext;
+    unlinkRecent(cache, entry);
+
+    entry->evicted = 1;
+    if (entry->references == 0)
+    {
+        destroyEntry(cache, entry);
+    }
+}
+
+/*
+ * Find the mapped content of `name` if the file still is the one that was
+ * mapped, according to `st` taken from it just before.
+ * Returns the entry, to be released once sent, or NULL on a miss.
+ */
+struct CachedFile *fileCacheLookup(struct FileCache *cache, const char *name,
+                                   const struct stat *st)
+{
+    struct CachedFile *entry = findEntry(cache, name);
+    if (entry == NULL || entry->device != st->st_dev || entry->inode != st->st_ino ||
+        entry->size != (uint64_t)st->st_size || entry->mtime.tv_sec != st->st_mtim.tv_sec ||
+        entry->mtime.tv_nsec != st->st_mtim.tv_nsec)
+    {
+        cache->stats->cacheMisses++;
+        return NULL;
+    }
+
+    cache->stats->cacheHits++;
+    unlinkRecent(cache, entry);
+    pushRecent(cache, entry);
+    entry->references++;
+    return entry;
+}
+
+/*
+ * Map the open file `fd` of `name`, described by `st`, evicting the least
+ * recently used files until it fits. Empty files and files too large for
+ * their share of the cache are left out.
+ * Returns the entry, to be released once sent, or NULL if it is not cached.
+ */
+struct CachedFile *fileCacheAdd(struct FileCache *cache, const char *name, int fd,
+                                const struct stat *st)
+{
+    uint64_t size = st->st_size;
+    if (size == 0 || size > cache->capacity / FILE_CACHE_SHARE)
+    {
+        return NULL;
+    }
+
+    // An outdated copy goes first, then whatever is needed to make room;
+    // only files still being sent can keep it full
+    fileCacheInvalidate(cache, name);
+    while (cache->used + size > cache->capacity && cache->oldest != NULL)
+    {
+        evictEntry(cache, cache->oldest);
+        cache->stats->cacheEvictions++;
+    }
+    if (cache->used + size > cache->capacity)
+    {
+        return NULL;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+    struct CachedFile *entry = malloc(sizeof(*entry));
+    if (entry == NULL)
+    {
+        munmap(data, size);
+        return NULL;
+    }
+    madvise(data, size, MADV_WILLNEED);
+
+    entry->data = data;
+    entry->size = size;
+    entry->device = st->st_dev;
+    entry->inode = st->st_ino;
+    entry->mtime = st->st_mtim;
+    entry->references = 1;
+    entry->evicted = 0;
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+
+    size_t bucket = bucketOf(entry->name);
+    entry->bucketNext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    pushRecent(cache, entry);
+    cache->used += size;
+    return entry;
+}
+
+/*
+ * Give back an entry taken by fileCacheLookup or fileCacheAdd.
+ */
+void fileCacheRelease(struct FileCache *cache, struct CachedFile *entry)
+{
+    entry->references--;
+    if (entry->references == 0 && entry->evicted)
+    {
+        destroyEntry(cache, entry);
+    }
+}
+
+/*
+ * Forget the cached content of `name`, replaced by a received file.
+ */
+void fileCacheInvalidate(struct FileCache *cache, const char *name)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    struct CachedFile *entry = findEntry(cache, name);
+    if (entry != NULL)
+    {
+        evictEntry(cache, entry);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+#pragma once
+
+#include "protocol.h"
+#include "stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Buckets of the name index of one cache
+#define FILE_CACHE_BUCKETS 1024
+
+// Files larger than this share of the capacity are never cached, so one
+// large download cannot evict every hot file
+#define FILE_CACHE_SHARE 8
+
+/*
+ * A file mapped in memory, identified by its name and the inode, size and
+ * modification time it had when it was mapped. An entry evicted while a
+ * download still sends from it is only unmapped once released.
+ */
+struct CachedFile
+{
+    struct CachedFile *bucketNext;
+    struct CachedFile *newer;
+    struct CachedFile *older;
+    const char *data;
+    uint64_t size;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    int references;
+    int evicted;
+    char name[MAX_NAME_LENGTH + 1];
+};
+
+/*
+ * Hot files of one worker, bounded by the bytes they map and evicted in
+ * least recently used order. A worker is a single-threaded process, so the
+ * cache is never shared and needs no locking; the kernel shares the mapped
+ * pages between the workers.
+ */
+struct FileCache
+{
+    struct CachedFile *buckets[FILE_CACHE_BUCKETS];
+    struct CachedFile *newest;
+    struct CachedFile *oldest;
+    size_t capacity;
+    size_t used;
+    struct WorkerStats *stats;
+};
+
+void fileCacheConfigure(size_t capacity);
+
+struct FileCache *fileCacheCreate(struct WorkerStats *stats);
+
+struct CachedFile *fileCacheLookup(struct FileCache *cache, const char *name,
+                                   const struct stat *st);
+
+struct CachedFile *fileCacheAdd(struct FileCache *cache, const char *name, int fd,
+                                const struct stat *st);
+
+void fileCacheRelease(struct FileCache *cache, struct CachedFile *entry);
+
+void fileCacheInvalidate(struct FileCache *cache, const char *name);
+
+#endif
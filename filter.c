@@ -0,0 +1,194 @@
+#include "filter.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILTER_SIMD 1
+#endif
+
+/*
+ * Remove special characters, except line breaks and spaces. Letters and
+ * digits are the ASCII ones, as isalnum in the C locale.
+ */
+int isSpecialCharacter(char c)
+{
+    unsigned char u = c;
+    unsigned char lower = u | 0x20;
+    if ((u >= '0' && u <= '9') || (lower >= 'a' && lower <= 'z') || c == ' ' || c == '\n')
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Compact str[i..length) to str[j..], one byte at a time. Finishes the
+ * vector kernels and is the whole of the scalar one.
+ * Returns the new length.
+ */
+static size_t filterTail(char *str, size_t i, size_t j, size_t length)
+{
+    for (; i < length; i++)
+    {
+        if (!isSpecialCharacter(str[i]))
+        {
+            str[j++] = str[i];
+        }
+    }
+    return j;
+}
+
+static size_t filterScalar(char *str, size_t length)
+{
+    return filterTail(str, 0, 0, length);
+}
+
+#ifdef FILTER_SIMD
+
+/*
+ * Byte-class mask of 16 bytes: 0xff for the bytes to keep. Bytes from 0x80
+ * are negative as signed bytes, so they never pass the range checks.
+ */
+static __m128i keepMask128(__m128i v)
+{
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    return _mm_or_si128(_mm_or_si128(digit, letter), blank);
+}
+
+/*
+ * SSE2 kernel: classify 16 bytes at once, copy vectors that are kept
+ * entirely and compact mixed ones by walking the bits of their mask.
+ */
+static size_t filterSse2(char *str, size_t length)
+{
+    size_t i = 0, j = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        unsigned mask = _mm_movemask_epi8(keepMask128(v));
+        if (mask == 0xffff)
+        {
+            _mm_storeu_si128((__m128i *)(str + j), v);
+            j += 16;
+            continue;
+        }
+        for (; mask != 0; mask &= mask - 1)
+        {
+            str[j++] = str[i + __builtin_ctz(mask)];
+        }
+    }
+    return filterTail(str, i, j, length);
+}
+
+// pshufb controls moving the kept bytes of an 8-byte group to its front
+static uint64_t compactTable[256];
+
+static void buildCompactTable(void)
+{
+    for (unsigned mask = 0; mask < 256; mask++)
+    {
+        uint64_t control = 0;
+        int out = 0;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            if (mask & (1u << bit))
+            {
+                control |= (uint64_t)bit << (8 * out++);
+            }
+        }
+        compactTable[mask] = control;
+    }
+}
+
+/*
+ * AVX2 kernel: classify 32 bytes at once, then compact each 8-byte group
+ * with one shuffle from compactTable. Every store stays below the end of
+ * the vector already loaded, so the compaction can run in place.
+ */
+__attribute__((target("avx2,popcnt"))) static size_t filterAvx2(char *str, size_t length)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i case20 = _mm256_set1_epi8(0x20);
+
+    size_t i = 0, j = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i lower = _mm256_or_si256(v, case20);
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                          _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, newline));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(digit, letter), blank));
+
+        if (mask == 0xffffffffu)
+        {
+            _mm256_storeu_si256((__m256i *)(str + j), v);
+            j += 32;
+            continue;
+        }
+
+        __m128i halves[2] = {_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)};
+        for (int group = 0; group < 4; group++)
+        {
+            unsigned bits = (mask >> (8 * group)) & 0xff;
+            __m128i bytes = halves[group >> 1];
+            if (group & 1)
+            {
+                bytes = _mm_srli_si128(bytes, 8);
+            }
+            __m128i control = _mm_loadl_epi64((const __m128i *)&compactTable[bits]);
+            _mm_storel_epi64((__m128i *)(str + j), _mm_shuffle_epi8(bytes, control));
+            j += __builtin_popcount(bits);
+        }
+    }
+    return filterTail(str, i, j, length);
+}
+
+#endif
+
+/*
+ * Pick the widest kernel the CPU supports.
+ */
+static size_t (*chooseKernel(void))(char *, size_t)
+{
+#ifdef FILTER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        buildCompactTable();
+        return filterAvx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return filterSse2;
+    }
+#endif
+    return filterScalar;
+}
+
+/*
+ * Compact the first `length` bytes of str in place, dropping special
+ * characters. Works on any piece of the content, so it runs chunk by chunk
+ * as the file streams through; the kernel is chosen on the first call.
+ * Returns the new length.
+ */
+size_t removeSpecialCharacters(char *str, size_t length)
+{
+    static size_t (*kernel)(char *, size_t);
+    if (kernel == NULL)
+    {
+        kernel = chooseKernel();
+    }
+    return kernel(str, length);
+}
@@ -0,0 +1,11 @@
+#ifndef FILTER_H
+#define FILTER_H
+#pragma once
+
+#include <stddef.h>
+
+int isSpecialCharacter(char c);
+
+size_t removeSpecialCharacters(char *str, size_t length);
+
+#endif
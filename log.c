@@ -0,0 +1,166 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+// Lines written by one writev
+#define LOG_BATCH 64
+
+/*
+ * Lines formatted by the event loop and written by the log thread. There is
+ * one producer and one consumer, so the ring only needs the two indexes,
+ * each written by one side.
+ */
+struct LogRing
+{
+    char lines[LOG_SLOTS][LOG_LINESZ];
+    unsigned short lengths[LOG_SLOTS];
+    uint64_t head;
+    uint64_t tail;
+};
+
+static struct LogRing ring;
+static struct WorkerStats *logStats;
+static int logRate = LOG_RATE;
+static int started;
+static time_t windowStart;
+static int windowLines;
+
+/*
+ * Set how many lines per second are written, 0 to write none. Called once,
+ * before the workers start.
+ */
+void logConfigure(int rate)
+{
+    logRate = rate;
+}
+
+/*
+ * Log thread: write the queued lines in batches, and say how many were
+ * dropped since the previous batch.
+ */
+static void *logThread(void *arg)
+{
+    (void)arg;
+    struct timespec idle = {0, LOG_IDLE_NS};
+    uint64_t reported = 0;
+
+    while (1)
+    {
+        uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        uint64_t dropped = __atomic_load_n(&logStats->logDropped, __ATOMIC_RELAXED);
+        if (head == ring.tail && dropped == reported)
+        {
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        struct iovec iov[LOG_BATCH];
+        int count = 0;
+        uint64_t tail = ring.tail;
+        while (tail != head && count < LOG_BATCH)
+        {
+            size_t slot = tail % LOG_SLOTS;
+            iov[count].iov_base = ring.lines[slot];
+            iov[count].iov_len = ring.lengths[slot];
+            count++;
+            tail++;
+        }
+
+        char note[64];
+        if (dropped != reported && count < LOG_BATCH)
+        {
+            iov[count].iov_base = note;
+            iov[count].iov_len = snprintf(note, sizeof(note), "%llu log lines dropped\n",
+                                          (unsigned long long)(dropped - reported));
+            count++;
+            reported = dropped;
+        }
+
+        if (writev(STDOUT_FILENO, iov, count) < 0)
+        {
+            // Nowhere left to report it, the lines are lost
+        }
+        __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * Start the log thread of the calling process, counting the dropped lines in
+ * `stats`. Until then, and if the thread cannot be started, lines are
+ * printed directly.
+ */
+void logStart(struct WorkerStats *stats)
+{
+    logStats = stats;
+    fflush(stdout);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, logThread, NULL) == 0)
+    {
+        pthread_detach(thread);
+        started = 1;
+    }
+}
+
+/*
+ * Queue a line for the log thread, so the event loop never waits for the
+ * terminal or the disk. Beyond the configured rate, or when the ring is
+ * full, the line is dropped and counted. Only the event loop logs.
+ */
+void logPrintf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if (!started)
+    {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+    if (logRate == 0)
+    {
+        va_end(args);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec != windowStart)
+    {
+        windowStart = now.tv_sec;
+        windowLines = 0;
+    }
+
+    uint64_t head = ring.head;
+    if (windowLines == logRate ||
+        head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == LOG_SLOTS)
+    {
+        __atomic_add_fetch(&logStats->logDropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+    windowLines++;
+
+    size_t slot = head % LOG_SLOTS;
+    int length = vsnprintf(ring.lines[slot], LOG_LINESZ, format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return;
+    }
+    if (length >= LOG_LINESZ)
+    {
+        // A truncated line still ends the line
+        length = LOG_LINESZ - 1;
+        ring.lines[slot][length - 1] = '\n';
+    }
+    ring.lengths[slot] = length;
+    __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+}
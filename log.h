@@ -0,0 +1,23 @@
+#ifndef LOG_H
+#define LOG_H
+#pragma once
+
+#include "stats.h"
+
+// Lines waiting for the log thread; more are dropped
+#define LOG_SLOTS 1024
+#define LOG_LINESZ 320
+
+// Lines written per second unless configured otherwise
+#define LOG_RATE 1000
+
+// How long the log thread sleeps when there is nothing to write
+#define LOG_IDLE_NS (10 * 1000 * 1000)
+
+void logConfigure(int rate);
+
+void logStart(struct WorkerStats *stats);
+
+void logPrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
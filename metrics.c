@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+#include "protocol.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * A counter or gauge of the worker stats and how it is exposed.
+ */
+struct Metric
+{
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+};
+
+static const struct Metric metrics[] = {
+    {"fts_connections_total", "counter", "Clients accepted.",
+     offsetof(struct WorkerStats, connections)},
+    {"fts_connections_open", "gauge", "Clients connected.",
+     offsetof(struct WorkerStats, openConnections)},
+    {"fts_files_received_total", "counter", "Files received, stored or not.",
+     offsetof(struct WorkerStats, files)},
+    {"fts_downloads_total", "counter", "Files or ranges sent to clients.",
+     offsetof(struct WorkerStats, downloads)},
+    {"fts_received_bytes_total", "counter", "Payload bytes received from clients.",
+     offsetof(struct WorkerStats, bytesReceived)},
+    {"fts_sent_bytes_total", "counter", "Bytes of replies and downloads sent to clients.",
+     offsetof(struct WorkerStats, bytesSent)},
+    {"fts_syscalls_total", "counter", "System calls made by the event loop.",
+     offsetof(struct WorkerStats, syscalls)},
+    {"fts_cache_hits_total", "counter", "Downloads served from the hot-file cache.",
+     offsetof(struct WorkerStats, cacheHits)},
+    {"fts_cache_misses_total", "counter", "Downloads whose file was not cached.",
+     offsetof(struct WorkerStats, cacheMisses)},
+    {"fts_cache_evictions_total", "counter", "Files evicted from the hot-file cache.",
+     offsetof(struct WorkerStats, cacheEvictions)},
+    {"fts_disk_queue_depth", "gauge", "Write-behind buffers waiting for a disk thread.",
+     offsetof(struct WorkerStats, diskQueued)},
+    {"fts_log_dropped_total", "counter", "Log lines dropped by the rate limit.",
+     offsetof(struct WorkerStats, logDropped)},
+    {"fts_bad_chunks_total", "counter", "Checked chunks whose CRC32C did not match.",
+     offsetof(struct WorkerStats, badChunks)},
+};
+
+struct MetricsServer
+{
+    int listener;
+    const struct WorkerStats *stats;
+    int workers;
+};
+
+static uint64_t loadField(const struct WorkerStats *stats, size_t offset)
+{
+    return __atomic_load_n((const uint64_t *)((const char *)stats + offset), __ATOMIC_RELAXED);
+}
+
+/*
+ * Write a histogram of every worker in cumulative buckets, `scale` turning
+ * the recorded values into the exposed unit.
+ */
+static void writeHistogram(FILE *out, const char *name, const char *help,
+                           const struct MetricsServer *server, size_t offset, double scale)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < server->workers; i++)
+    {
+        const struct WorkerStats *stats = &server->stats[i];
+        uint64_t cumulative = 0;
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+        {
+            cumulative += loadField(stats, offset + offsetof(struct Histogram, buckets) +
+                                               bucket * sizeof(uint64_t));
+            if (bucket < HISTOGRAM_BUCKETS - 1)
+                fprintf(out, "%s_bucket{worker=\"%d\",le=\"%.15g\"} %llu\n", name, i,
+                        (double)(1ull << bucket) / scale, (unsigned long long)cumulative);
+            else
+                fprintf(out, "%s_bucket{worker=\"%d\",le=\"+Inf\"} %llu\n", name, i,
+                        (unsigned long long)cumulative);
+        }
+        fprintf(out, "%s_sum{worker=\"%d\"} %.15g\n", name, i,
+                loadField(stats, offset + offsetof(struct Histogram, sum)) / scale);
+        fprintf(out, "%s_count{worker=\"%d\"} %llu\n", name, i,
+                (unsigned long long)loadField(stats, offset + offsetof(struct Histogram, count)));
+    }
+}
+
+/*
+ * Write every metric of every worker in the Prometheus text format.
+ */
+static void writeMetrics(FILE *out, const struct MetricsServer *server)
+{
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++)
+    {
+        const struct Metric *metric = &metrics[m];
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metric->name, metric->help, metric->name,
+                metric->type);
+        for (int i = 0; i < server->workers; i++)
+        {
+            fprintf(out, "%s{worker=\"%d\"} %llu\n", metric->name, i,
+                    (unsigned long long)loadField(&server->stats[i], metric->offset));
+        }
+    }
+    writeHistogram(out, "fts_recv_bytes", "Bytes moved by one receive from a client.", server,
+                   offsetof(struct WorkerStats, recvSizes), 1);
+    writeHistogram(out, "fts_transfer_seconds",
+                   "Time from the header of a received file to its reply.", server,
+                   offsetof(struct WorkerStats, transferMicros), 1e6);
+}
+
+/*
+ * Answer one scrape: the metrics for GET / or /metrics, 404 otherwise.
+ */
+static void serveScrape(int client, const struct MetricsServer *server)
+{
+    char request[METRICS_REQUESTSZ];
+    ssize_t count = recv(client, request, sizeof(request) - 1, 0);
+    if (count <= 0)
+    {
+        return;
+    }
+    request[count] = '\0';
+    int found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+
+    char *body = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&body, &length);
+    if (out == NULL)
+    {
+        return;
+    }
+    if (found)
+    {
+        writeMetrics(out, server);
+    }
+    fclose(out);
+
+    char head[160];
+    int headLength = snprintf(head, sizeof(head),
+                              "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                              found ? "200 OK" : "404 Not Found", length);
+    if (sendAll(client, head, headLength) == 0)
+    {
+        sendAll(client, body, length);
+    }
+    free(body);
+}
+
+static void *metricsThread(void *arg)
+{
+    struct MetricsServer *server = arg;
+    struct timeval timeout = {METRICS_TIMEOUT, 0};
+
+    while (1)
+    {
+        int client = accept4(server->listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1)
+        {
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serveScrape(client, server);
+        close(client);
+    }
+    return NULL;
+}
+
+/*
+ * Serve the counters of the workers over HTTP on the loopback interface,
+ * from a thread of the calling process, away from the event loops. The
+ * stats are read as the workers update them, without locking.
+ * Returns 0 on success, -1 if the port cannot be listened on.
+ */
+int metricsStart(const char *port, const struct WorkerStats *stats, int workers)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int enable = 1;
+    if (s == -1 || setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+        bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(s, 16) != 0)
+    {
+        if (s != -1)
+            close(s);
+        return -1;
+    }
+
+    static struct MetricsServer server;
+    server.listener = s;
+    server.stats = stats;
+    server.workers = workers;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metricsThread, &server) != 0)
+    {
+        close(s);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef METRICS_H
+#define METRICS_H
+#pragma once
+
+#include "stats.h"
+
+// Bytes of a scrape request read before answering
+#define METRICS_REQUESTSZ 1024
+
+// Seconds a scraper may take to send its request
+#define METRICS_TIMEOUT 1
+
+int metricsStart(const char *port, const struct WorkerStats *stats, int workers);
+
+#endif
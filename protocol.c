@@ -0,0 +1,243 @@
+#include "protocol.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * Serialize a frame header into FRAME_HEADER_SIZE bytes.
+ * - header is the input
+ * - out is the result
+ */
+void encodeHeader(const struct FrameHeader *header, unsigned char *out)
+{
+    uint32_t magic = htobe32(header->magic);
+    uint16_t nameLength = htobe16(header->nameLength);
+    uint32_t status = htobe32(header->status);
+    uint64_t payloadLength = htobe64(header->payloadLength);
+
+    memcpy(out, &magic, 4);
+    out[4] = header->version;
+    out[5] = header->opcode;
+    memcpy(out + 6, &nameLength, 2);
+    memcpy(out + 8, &status, 4);
+    memcpy(out + 12, &payloadLength, 8);
+}
+
+/*
+ * Parse FRAME_HEADER_SIZE bytes into a frame header.
+ * Returns 0 on success, -1 if the magic or the version do not match.
+ */
+int decodeHeader(const unsigned char *in, struct FrameHeader *header)
+{
+    uint32_t magic;
+    uint16_t nameLength;
+    uint32_t status;
+    uint64_t payloadLength;
+
+    memcpy(&magic, in, 4);
+    memcpy(&nameLength, in + 6, 2);
+    memcpy(&status, in + 8, 4);
+    memcpy(&payloadLength, in + 12, 8);
+
+    header->magic = be32toh(magic);
+    header->version = in[4];
+    header->opcode = in[5];
+    header->nameLength = be16toh(nameLength);
+    header->status = be32toh(status);
+    header->payloadLength = be64toh(payloadLength);
+
+    if (header->magic != FRAME_MAGIC || header->version != FRAME_VERSION)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fill a frame header with the protocol magic and version.
+ */
+void initHeader(struct FrameHeader *header, uint8_t opcode, uint16_t nameLength,
+                uint64_t payloadLength)
+{
+    memset(header, 0, sizeof(*header));
+    header->magic = FRAME_MAGIC;
+    header->version = FRAME_VERSION;
+    header->opcode = opcode;
+    header->nameLength = nameLength;
+    header->payloadLength = payloadLength;
+}
+
+/*
+ * Send exactly `length` bytes, retrying on short writes.
+ * Returns 0 on success, -1 on failure.
+ */
+int sendAll(int s, const void *buf, size_t length)
+{
+    const char *p = buf;
+    while (length > 0)
+    {
+        ssize_t count = send(s, p, length, MSG_NOSIGNAL);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return -1;
+        }
+        p += count;
+        length -= count;
+    }
+    return 0;
+}
+
+/*
+ * Send every byte described by the iovec array with as few vectored writes
+ * as the socket allows. The array is modified.
+ * Returns 0 on success, -1 on failure.
+ */
+int sendAllv(int s, struct iovec *iov, int count)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len)
+        {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Receive exactly `length` bytes, retrying on short reads.
+ * Returns 0 on success, -1 on failure or if the peer closed the connection.
+ */
+int recvAll(int s, void *buf, size_t length)
+{
+    char *p = buf;
+    while (length > 0)
+    {
+        ssize_t count = recv(s, p, length, 0);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return -1;
+        }
+        p += count;
+        length -= count;
+    }
+    return 0;
+}
+
+/*
+ * Send the header and the name of a frame whose payload is streamed by the
+ * caller right after. `name` may be NULL for frames without a name.
+ * Returns 0 on success, -1 on failure.
+ */
+int sendFrameHeader(int s, uint8_t opcode, uint32_t status, const char *name,
+                    uint64_t payloadLength)
+{
+    size_t nameLength = name != NULL ? strlen(name) : 0;
+    if (nameLength > MAX_NAME_LENGTH)
+    {
+        return -1;
+    }
+
+    struct FrameHeader header;
+    initHeader(&header, opcode, (uint16_t)nameLength, payloadLength);
+    header.status = status;
+
+    unsigned char raw[FRAME_HEADER_SIZE];
+    encodeHeader(&header, raw);
+
+    if (sendAll(s, raw, FRAME_HEADER_SIZE) != 0)
+    {
+        return -1;
+    }
+    if (nameLength > 0 && sendAll(s, name, nameLength) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send a complete frame: header, name and an in-memory payload.
+ * `name` and `payload` may be NULL when their length is zero.
+ * Returns 0 on success, -1 on failure.
+ */
+int sendFrame(int s, uint8_t opcode, uint32_t status, const char *name,
+              const void *payload, uint64_t payloadLength)
+{
+    if (sendFrameHeader(s, opcode, status, name, payloadLength) != 0)
+    {
+        return -1;
+    }
+    if (payloadLength > 0 && sendAll(s, payload, payloadLength) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Receive and decode a frame header.
+ * Returns 0 on success, -1 on failure or on a malformed header.
+ */
+int recvHeader(int s, struct FrameHeader *header)
+{
+    unsigned char raw[FRAME_HEADER_SIZE];
+    if (recvAll(s, raw, FRAME_HEADER_SIZE) != 0)
+    {
+        return -1;
+    }
+    return decodeHeader(raw, header);
+}
+
+/*
+ * Write the whole buffer to the file, retrying on short writes.
+ * Returns 0 on success, -1 on failure.
+ */
+int writeAll(int fd, const char *buf, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = write(fd, buf, length);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return -1;
+        buf += count;
+        length -= count;
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Wire format
+ *
+ * Every message is a fixed 20 byte header followed by `nameLength` bytes of
+ * file name and `payloadLength` bytes of raw payload. All integers are sent
+ * in network byte order.
+ *
+ *   0      4   5   6     8        12               20
+ *   +------+---+---+-----+--------+----------------+
+ *   |magic |ver|op |nlen | status | payload length |  name ... payload ...
+ *   +------+---+---+-----+--------+----------------+
+ *
+ * Replies carry a status code in the status field; requests use it for flags.
+ */
+#define FRAME_MAGIC 0x46545331u /* "FTS1" */
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 20
+#define MAX_NAME_LENGTH 255
+
+// Size of the reusable buffers used to stream payloads
+#define CHUNKSZ (64 * 1024)
+
+// Frame opcodes
+enum Opcode
+{
+    OP_SEND = 1,
+    OP_EXIT = 2,
+    OP_REPLY = 3,
+    OP_BATCH_BEGIN = 4,
+    OP_BATCH_END = 5,
+    OP_BATCH_REPLY = 6,
+    OP_BUNDLE = 7,
+    OP_RESUME = 8,
+    OP_LOOKUP = 9,
+    OP_SIGNATURE = 10,
+    OP_DELTA = 11,
+    OP_RANGE = 12,
+    OP_COMMIT = 13,
+    OP_HELLO = 14,
+    OP_GET = 15
+};
+
+// Flags of OP_SEND frames
+#define SEND_RESUME 1u
+#define SEND_COMPRESSED 2u
+#define SEND_CHECKED 4u
+
+/*
+ * Capability handshake: OP_HELLO carries the 32-bit capabilities the client
+ * wants to use; the server answers a STATUS_HELLO reply with those it
+ * supports too. Compressed payloads (SEND_COMPRESSED, chunk format in
+ * compress.h) may only be sent once CAP_COMPRESS was agreed on; they are
+ * streamed as they are compressed, so the frame has a payload length of 0
+ * and the content runs up to its CHUNK_END word.
+ */
+#define CAP_COMPRESS 1u
+#define CAP_CHECKSUM 2u
+#define HELLO_SIZE 4
+
+/*
+ * Checked transfers: once CAP_CHECKSUM was agreed on, an uncompressed
+ * OP_SEND flagged SEND_CHECKED carries its content as chunks of CHUNKSZ
+ * bytes, the last one shorter, each followed by the 32-bit CRC32C of the
+ * chunk; the payload length counts the checksums. From the first chunk
+ * whose checksum does not match, the content is dropped: the server keeps
+ * the good chunks in the .part file and answers STATUS_CORRUPT, and the
+ * client resends the rest with OP_RESUME.
+ */
+#define CHECKSUM_SIZE 4
+
+/*
+ * Resumable uploads: the server stores a file flagged SEND_RESUME or
+ * SEND_CHECKED as "<name>.part" until its last byte arrived, and refuses a
+ * second such upload of the same name while it is written; other uploads
+ * go to a private file dropped if they fail. OP_RESUME carries the name
+ * and, as an 8 byte payload, the full length of the file; the server
+ * answers with a STATUS_RESUME reply whose 8 byte payload is the offset it
+ * already holds. An OP_SEND flagged SEND_RESUME then carries only the bytes
+ * from that offset on.
+ */
+#define PART_SUFFIX ".part"
+
+/*
+ * Deduplication: OP_LOOKUP carries the name and, as payload, the SHA-256 of
+ * the content about to be sent. If the server already stores that content
+ * it creates the file from its store and replies as if it had been sent;
+ * otherwise it replies STATUS_MISSING and the client sends the file.
+ */
+
+/*
+ * Delta transfer: OP_SIGNATURE carries only the name; the server answers a
+ * STATUS_SIGNATURES reply with the block signatures of its copy (see
+ * delta.h), whose block size is 0 if it has no copy. The client then sends
+ * OP_DELTA with the instructions rebuilding the file from that copy.
+ */
+
+/*
+ * Multi-stream transfers: a large file is split into ranges sent over
+ * parallel connections. The payload of OP_RANGE starts with a range header
+ * id(64) offset(64) length(64), the random id of the transfer, the offset of
+ * the range and the full length of the file, followed by the range content.
+ * Ranges go to "<name>.<id>.part"; once every range was acknowledged the
+ * client sends OP_COMMIT with id(64) length(64) to move the file into place,
+ * which the server only does if the ranges it wrote cover the whole length.
+ * A range whose total the server has no room for is not written.
+ */
+#define RANGE_HEADER_SIZE 24
+#define COMMIT_SIZE 16
+
+/*
+ * Downloads: OP_GET carries the name and offset(64) length(64) of the bytes
+ * wanted, a length of 0 meaning up to the end of the file. The server
+ * answers a STATUS_CONTENT reply whose payload is the full length(64) of the
+ * file followed by the content of the range.
+ */
+#define GET_SIZE 16
+#define CONTENT_HEADER_SIZE 8
+
+/*
+ * Batches: between OP_BATCH_BEGIN and OP_BATCH_END the server does not reply
+ * to each OP_SEND. OP_BATCH_END is answered by one OP_BATCH_REPLY whose
+ * payload holds the 32-bit status of every file, in the order they were sent.
+ * Requests answered on their own, OP_RESUME included, are refused in a batch.
+ *
+ * Bundles: the payload of OP_BUNDLE packs many small files. It starts with a
+ * 32-bit entry count and one index entry per file, followed by the contents
+ * of all files back to back. Offsets are relative to the end of the index.
+ *
+ *   count | nlen(16) offset(32) length(32) name | ... | data ...
+ *
+ * Each entry gets a status as if it had been sent alone; a bundle sent
+ * outside of a batch is answered by its own OP_BATCH_REPLY.
+ */
+#define BUNDLE_MAX (1024 * 1024)
+#define BUNDLE_ENTRY_SIZE 10
+
+// Status codes carried by OP_REPLY frames
+enum Status
+{
+    STATUS_RECEIVED = 0,
+    STATUS_OVERWRITTEN = 1,
+    STATUS_INVALID_NAME = 2,
+    STATUS_ERROR = 3,
+    STATUS_RESUME = 4,
+    STATUS_MISSING = 5,
+    STATUS_SIGNATURES = 6,
+    STATUS_HELLO = 7,
+    STATUS_CONTENT = 8,
+    STATUS_CORRUPT = 9
+};
+
+struct FrameHeader
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t nameLength;
+    uint32_t status;
+    uint64_t payloadLength;
+};
+
+void encodeHeader(const struct FrameHeader *header, unsigned char *out);
+
+int decodeHeader(const unsigned char *in, struct FrameHeader *header);
+
+void initHeader(struct FrameHeader *header, uint8_t opcode, uint16_t nameLength,
+                uint64_t payloadLength);
+
+int sendAll(int s, const void *buf, size_t length);
+
+int recvAll(int s, void *buf, size_t length);
+
+int writeAll(int fd, const char *buf, size_t length);
+
+struct iovec;
+
+int sendAllv(int s, struct iovec *iov, int count);
+
+int sendFrameHeader(int s, uint8_t opcode, uint32_t status, const char *name,
+                    uint64_t payloadLength);
+
+int sendFrame(int s, uint8_t opcode, uint32_t status, const char *name,
+              const void *payload, uint64_t payloadLength);
+
+int recvHeader(int s, struct FrameHeader *header);
+
+#endif
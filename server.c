@@ -1,16 +1,48 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <errno.h>
 #include "common.h"
+#include "connection.h"
+#include "disk.h"
+#include "filecache.h"
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "stats.h"
+#include "uring.h"
 
 #define BUFSZ 500
-#define SIZEOPTION 12
-#define MAXEXTENSIONLENGTH 4
+#define MAXEVENTS 256
+#define PIPESZ (1024 * 1024)
+
+/*
+ * Resources shared by every connection of one event loop
+ */
+struct Worker
+{
+    int epfd;
+    int pipeFds[2];
+    char chunk[CHUNKSZ];
+    struct WorkerStats *stats;
+    struct DiskQueue *disk;
+    struct FileCache *cache;
+    struct ConnectionPool pool;
+    struct Connection *closed;
+};
 
 /**
  * Prints the usage of the server program
@@ -21,123 +53,336 @@
 
 void serverUsage(int argc, char **argv)
 {
-    printf("usage: %s <v4 or v6> <server port>\n", argv[0]);
+    printf("usage: %s [-j workers] [-u] [-q depth] [-s none|file|group] [-m megabytes]\n"
+           "       [-l lines] [-M port] <v4 or v6> <server port>\n",
+           argv[0]);
+    printf("  -j  number of worker processes sharing the port, reporting their throughput\n");
+    printf("  -u  use the io_uring engine instead of epoll when the kernel supports it\n");
+    printf("  -q  write payloads from disk threads, through this many %d KB buffers per worker\n",
+           DISK_BUFSZ / 1024);
+    printf("  -s  fsync policy of received files: none, per file, or one group commit for\n"
+           "      the files finishing together (default none)\n");
+    printf("  -m  keep this many MB of hot files mapped in memory for get file, per worker\n");
+    printf("  -l  log at most this many lines per second per worker, 0 for none\n"
+           "      (default %d)\n",
+           LOG_RATE);
+    printf("  -M  serve Prometheus metrics over HTTP on this port of the loopback interface\n");
     exit(EXIT_FAILURE);
 }
 
 /**
- * Checks if the given string ends with "\\end"
+ * Raises the open file limit to the hard limit so thousands of clients can
+ * be connected at once
+ */
+void raiseFileLimit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/**
+ * Reads everything the client has sent so far and feeds it to its state
+ * machine, then flushes the queued replies and downloads. Large payloads are
+ * spliced from the socket to the file instead of being read into the chunk
+ * buffer.
  *
- * - str: The input string to check
+ * - worker: The event loop the connection belongs to
+ * - conn: The client connection
  *
  * Returns:
- *  1 if the string ends with "\\end", 0 otherwise
+ *  0 to keep the connection, -1 to close it
  */
-int endsWithEnd(const char *str)
+int handleReadable(struct Worker *worker, struct Connection *conn)
 {
-    const char *suffix = "\\end";
-    size_t strLength = strlen(str);
-    size_t suffixLength = strlen(suffix);
-
-    if (suffixLength > strLength)
+    int drained = 0;
+    while (1)
     {
-        return 0;
-    }
+        // Edge-triggered: drain the socket until it would block, unless the
+        // connection waits or the client is not reading its replies
+        while (!drained && connectionWantsInput(conn))
+        {
+            if (connectionCanSplice(conn))
+            {
+                int spliced = connectionSplice(conn, worker->pipeFds);
+                if (spliced == -1)
+                    return -1;
+                drained = (spliced == 0);
+                continue;
+            }
+
+            ssize_t count = recv(conn->socket, worker->chunk, CHUNKSZ, 0);
+            worker->stats->syscalls++;
 
-    const char *strSuffix = str + (strLength - suffixLength);
+            if (count > 0)
+            {
+                statsObserve(&worker->stats->recvSizes, count);
+                if (connectionFeed(conn, worker->chunk, count) != 0)
+                    return -1;
+                continue;
+            }
+            if (count == 0)
+                return -1;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                drained = 1;
+                continue;
+            }
+            return -1;
+        }
 
-    return strcmp(strSuffix, suffix) == 0;
+        int flushed = connectionFlush(conn);
+        if (flushed == -1 || (flushed == 1 && conn->state == STATE_CLOSING))
+            return -1;
+        // Input paused for the output may be read again once it went out,
+        // as no new edge will report the bytes already waiting
+        if (flushed == 0 || drained || !connectionWantsInput(conn))
+            return 0;
+    }
 }
 
 /**
- * Removes the "\\end" from the given string
+ * Sends pending replies and downloads once the socket is writable again,
+ * and resumes reading if it was paused for them
  *
- * - str: The input string to modify
+ * Returns:
+ *  0 to keep the connection, -1 to close it
  */
+int handleWritable(struct Worker *worker, struct Connection *conn)
+{
+    return handleReadable(worker, conn);
+}
 
-void removeEnd(char *str)
+/**
+ * Accepts every pending client and registers it with epoll
+ *
+ * - worker: The event loop that will serve the clients
+ * - s: The non-blocking listening socket
+ */
+void acceptClients(struct Worker *worker, int s)
 {
-    char *endPtr = strstr(str, "\\end");
-    if (endPtr != NULL)
+    while (1)
     {
-        *endPtr = '\0';
+        struct sockaddr_storage cstorage;
+        struct sockaddr *caddr = (struct sockaddr *)(&cstorage);
+        socklen_t caddrlen = sizeof(cstorage);
+
+        // Accept a new client connection
+        int csock = accept4(s, caddr, &caddrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        worker->stats->syscalls++;
+        if (csock == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE)
+                logPrintf("too many open files, client left in the backlog\n");
+            return;
+        }
+
+        struct Connection *conn = connectionCreate(&worker->pool, csock, caddr, worker->stats);
+        if (conn == NULL)
+        {
+            close(csock);
+            continue;
+        }
+        conn->disk = worker->disk;
+        conn->cache = worker->cache;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, csock, &event) != 0)
+        {
+            connectionDestroy(conn);
+        }
     }
 }
 
 /**
- * Removes the name from the content
+ * Marks a connection to be destroyed once the current batch of events is
+ * handled, as later events of the batch may still point to it
  *
- * - name: The name to remove
- * - content: The content string to modify
+ * - worker: The event loop of the connection
+ * - conn: The client connection
  */
-
-int removeName(char *name, char *content)
+void closeLater(struct Worker *worker, struct Connection *conn)
 {
-    char *match = strstr(content, name);
-
-    if (match != NULL)
+    if (!conn->closed)
     {
-        size_t nameLen = strlen(name);
-        memmove(match, match + nameLen, strlen(match + nameLen) + 1);
-        return 1;
+        conn->closed = 1;
+        conn->nextClosed = worker->closed;
+        worker->closed = conn;
     }
-
-    return 0;
 }
 
+/**
+ * Destroys the connections closed during the batch of events
+ *
+ * - worker: The event loop of the connections
+ */
+void destroyClosed(struct Worker *worker)
+{
+    while (worker->closed != NULL)
+    {
+        struct Connection *conn = worker->closed;
+        worker->closed = conn->nextClosed;
+        connectionDestroy(conn);
+    }
+}
 
 /**
- * Gets the option bytes from the client
+ * Continues the connections the disk threads handed back, either done with
+ * their file or able to get a buffer again, and reads what their clients
+ * sent meanwhile
  *
- * - csock: The client socket
- * - buf: The buffer to store the received data
- * - bufferSize: The size of the buffer
+ * - worker: The event loop of the connections
+ */
+void handleDisk(struct Worker *worker)
+{
+    struct DiskFile *file = diskReap(worker->disk);
+    while (file != NULL)
+    {
+        struct DiskFile *next = file->next;
+        struct Connection *conn = file->owner;
+        if (!conn->closed && (connectionDiskReady(conn) != 0 || handleReadable(worker, conn) != 0))
+        {
+            closeLater(worker, conn);
+        }
+        file = next;
+    }
+}
+
+/**
+ * Runs the edge-triggered epoll reactor: one thread multiplexes every client,
+ * each one driven by its own connection state machine
  *
- * Returns:
- *  - the option enum if successful, or CONNECTION_CLOSED if the connection was closed
+ * - s: The listening socket
+ * - stats: The counters of this worker
  */
-enum Options getOptionBytes(int csock, char *buf)
+void runEventLoop(int s, struct WorkerStats *stats)
 {
-    int bytesReceived;
-    int option = 0;
+    static struct Worker worker;
+    struct epoll_event events[MAXEVENTS];
 
-    bytesReceived = recv(csock, buf, BUFSZ, 0);
+    worker.stats = stats;
+    connectionPoolInit(&worker.pool);
+    worker.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker.epfd == -1 || pipe2(worker.pipeFds, O_CLOEXEC) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    // A larger pipe lets one splice move more of the payload at once
+    fcntl(worker.pipeFds[1], F_SETPIPE_SZ, PIPESZ);
+
+    // The listening socket is the only entry without a connection
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (0 != epoll_ctl(worker.epfd, EPOLL_CTL_ADD, s, &event))
+    {
+        exit(EXIT_FAILURE);
+    }
 
-    if (bytesReceived == -1 || bytesReceived == 0)
-        return CONNECTION_CLOSED;
+    worker.cache = fileCacheCreate(stats);
 
-    if (endsWithEnd(buf)){
-        buf[bytesReceived] = '\0';
-        return SEND;
+    // The disk threads wake the loop through their eventfd
+    worker.disk = diskQueueCreate(stats);
+    if (worker.disk != NULL)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = worker.disk;
+        if (0 != epoll_ctl(worker.epfd, EPOLL_CTL_ADD, worker.disk->eventFd, &event))
+        {
+            exit(EXIT_FAILURE);
+        }
     }
 
-    if (strncmp(buf, "exit",4) == 0){
-        buf[bytesReceived-1] = '\0';
-        return EXIT;
-    }
-    
-    return INVALID_OPERATION;
+    while (1)
+    {
+        int ready = epoll_wait(worker.epfd, events, MAXEVENTS, -1);
+        stats->syscalls++;
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            exit(EXIT_FAILURE);
+        }
 
-}
+        for (int i = 0; i < ready; i++)
+        {
+            struct Connection *conn = events[i].data.ptr;
 
-int main(int argc, char *argv[])
-{
-    // Check the number of command-line arguments
-    if (argc < 3)
-    {
-        serverUsage(argc, argv);
+            if (conn == NULL)
+            {
+                acceptClients(&worker, s);
+                continue;
+            }
+            if ((void *)conn == worker.disk)
+            {
+                handleDisk(&worker);
+                continue;
+            }
+            if (conn->closed)
+            {
+                continue;
+            }
+
+            int result = 0;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                result = handleReadable(&worker, conn);
+            if (result == 0 && (events[i].events & EPOLLOUT))
+                result = handleWritable(&worker, conn);
+
+            if (result != 0)
+            {
+                closeLater(&worker, conn);
+            }
+        }
+
+        // Closing the sockets also removes them from the epoll set
+        destroyClosed(&worker);
     }
+}
 
-    // Initialize the socket address storage
-    struct sockaddr_storage storage;
-    if (0 != server_sockaddr_init(argv[1], argv[2], &storage))
+/**
+ * Serves clients with the selected engine, falling back to epoll when
+ * io_uring is not available. The log lines of the worker are written by a
+ * thread of its own.
+ *
+ * - s: The listening socket
+ * - stats: The counters of this worker
+ * - useUring: Whether the io_uring engine was requested
+ */
+void serve(int s, struct WorkerStats *stats, int useUring)
+{
+    logStart(stats);
+    if (useUring && runUringLoop(s, stats) != 0)
     {
-        serverUsage(argc, argv);
+        logPrintf("io_uring not available, using epoll\n");
     }
+    runEventLoop(s, stats);
+}
 
-    // Create a socket
+/**
+ * Creates a non-blocking socket listening on the address
+ *
+ * - storage: The address to bind
+ * - reusePort: Whether other processes may bind the same port, letting the
+ *   kernel spread incoming connections across them
+ *
+ * Returns:
+ *  the listening socket, exits on failure
+ */
+int openListener(struct sockaddr_storage *storage, int reusePort)
+{
+    // Create a non-blocking socket
     int s;
-    s = socket(storage.ss_family, SOCK_STREAM, 0);
+    s = socket(storage->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (s == -1)
     {
         exit(EXIT_FAILURE);
@@ -149,147 +394,169 @@ int main(int argc, char *argv[])
     {
         exit(EXIT_FAILURE);
     }
+    if (reusePort && 0 != setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)))
+    {
+        exit(EXIT_FAILURE);
+    }
 
     // Convert the sockaddr_storage to sockaddr
-    struct sockaddr *addr = (struct sockaddr *)(&storage);
+    struct sockaddr *addr = (struct sockaddr *)storage;
     // Bind the socket to the address
-    if (0 != bind(s, addr, sizeof(storage)))
+    if (0 != bind(s, addr, sizeof(*storage)))
     {
         exit(EXIT_FAILURE);
     }
 
     // Listen for incoming connections
-    if (0 != listen(s, 10))
+    if (0 != listen(s, SOMAXCONN))
     {
         exit(EXIT_FAILURE);
     }
+    return s;
+}
 
-    char addrstr[BUFSZ];
-    // Convert the socket address to a string representation
-    addrtostr(addr, addrstr, BUFSZ);
-
-    printf("Server on %s, waiting\n", addrstr);
+/**
+ * Forks the workers, each with its own SO_REUSEPORT socket and event loop,
+ * serves their metrics if asked to, then prints their throughput every
+ * REPORT_INTERVAL seconds. Returns only if a worker dies, after stopping
+ * the others.
+ *
+ * - storage: The address every worker binds
+ * - workers: The number of workers
+ * - useUring: Whether the workers use the io_uring engine
+ * - metricsPort: The local port of the metrics endpoint, or NULL
+ */
+void runWorkers(struct sockaddr_storage *storage, int workers, int useUring,
+                const char *metricsPort)
+{
+    struct WorkerStats *stats = statsCreate(workers);
+    struct WorkerStats previous[workers];
+    pid_t pids[workers];
 
-    while (1)
+    if (stats == NULL)
     {
-        struct sockaddr_storage cstorage;
-        struct sockaddr *caddr = (struct sockaddr *)(&cstorage);
-        socklen_t caddrlen = sizeof(cstorage);
-
-        // Accept a new client connection
-        int csock = accept(s, caddr, &caddrlen);
+        exit(EXIT_FAILURE);
+    }
+    memset(previous, 0, sizeof(previous));
+    fflush(stdout);
 
-        if (csock == -1)
+    for (int i = 0; i < workers; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == -1)
         {
             exit(EXIT_FAILURE);
         }
-
-        char caddrstr[BUFSZ];
-        // Convert the client socket address to a string representation
-        addrtostr(caddr, caddrstr, BUFSZ);
-
-        char buf[BUFSZ];
-        memset(buf, 0, BUFSZ);
-        size_t count;
-        char fileNameExtracted[BUFSZ];
-        int isReceivingFile = 0;
-        int overwrite = 0;
-        int option = -1;
-        FILE *file = NULL;
-        memset(fileNameExtracted, 0, BUFSZ);
-
-        while (1)
+        if (pids[i] == 0)
         {
-            memset(buf, 0, BUFSZ);
-            option = getOptionBytes(csock, buf);
+            // Do not outlive the parent
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            serve(openListener(storage, 1), &stats[i], useUring);
+            exit(EXIT_SUCCESS);
+        }
+    }
 
-            // Checks if there was a connection error while receiving bytes
-            if (option == CONNECTION_CLOSED)
-            {
-                if (isReceivingFile)
-                {
-                    extractFileNameExtension(buf, fileNameExtracted);
-                    printf("error receiving file %s\n", fileNameExtracted);
-                }
-                if (file != NULL)
-                {
-                    fclose(file);
-                    file = NULL;
-                }
-                break;
-            }
+    if (metricsPort != NULL && metricsStart(metricsPort, stats, workers) != 0)
+    {
+        printf("cannot serve metrics on port %s\n", metricsPort);
+    }
 
-            puts(buf);
+    struct timespec last;
+    clock_gettime(CLOCK_MONOTONIC, &last);
 
-            if (option == EXIT)
-            {
-                memset(buf, 0, BUFSZ);
-                printf("connection closed\n");
-                break;
-            }
+    while (waitpid(-1, NULL, WNOHANG) == 0)
+    {
+        sleep(REPORT_INTERVAL);
 
-            if (option==SEND)
-            {
-                extractFileNameExtension(buf, fileNameExtracted);
-                if (strlen(fileNameExtracted) != 0)
-                {
-                    if (fileExists(fileNameExtracted))
-                        overwrite = 1;
-                    else
-                        overwrite = 0;
-                    if (removeName(fileNameExtracted, buf) == 0)
-                    {
-                        printf("error receiving file %s\n", fileNameExtracted);
-                        break;
-                    }
-
-                    removeEnd(buf);
-
-                    file = fopen(fileNameExtracted, "w");
-
-                    if (file != NULL)
-                        fprintf(file, "%s", buf);
-
-                    if (overwrite)
-                    {
-                        char message[500];
-                        printf("file %s overwritten\n", fileNameExtracted);
-                        strcpy(message, "file ");
-                        strcat(message, fileNameExtracted);
-                        strcat(message, " overwritten");
-                        int count = send(csock, message, strlen(message), 0);
-
-                        if (count != strlen(message))
-                        {
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                    else
-                    {
-                        printf("file %s received\n", fileNameExtracted);
-                        char message[500];
-                        strcpy(message, "file ");
-                        strcat(message, fileNameExtracted);
-                        strcat(message, " received");
-                        int count = send(csock, message, strlen(message), 0);
-                    }
-
-                    if (file != NULL)
-                    {
-                        fclose(file);
-                        file = NULL;
-                    }
-                }
-            }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double seconds = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
 
-            memset(buf, 0, BUFSZ);
-        }
-        if (file != NULL)
-        {
-            fclose(file);
-            file = NULL;
-        }
-        close(csock);
+        statsReport(stats, previous, workers, seconds);
+    }
+
+    printf("worker died, stopping\n");
+    for (int i = 0; i < workers; i++)
+    {
+        kill(pids[i], SIGTERM);
     }
+}
+
+int main(int argc, char *argv[])
+{
+    int workers = 0;
+    int useUring = 0;
+    int depth = 0;
+    enum SyncPolicy policy = SYNC_NONE;
+    size_t cacheSize = 0;
+    int logRate = LOG_RATE;
+    const char *metricsPort = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:uq:s:m:l:M:")) != -1)
+    {
+        if (opt == 'j' && atoi(optarg) > 0)
+            workers = atoi(optarg);
+        else if (opt == 'u')
+            useUring = 1;
+        else if (opt == 'q' && atoi(optarg) > 0)
+            depth = atoi(optarg);
+        else if (opt == 's' && diskParsePolicy(optarg, &policy) == 0)
+            continue;
+        else if (opt == 'm' && atoi(optarg) > 0)
+            cacheSize = (size_t)atoi(optarg) * 1024 * 1024;
+        else if (opt == 'l' && atoi(optarg) >= 0)
+            logRate = atoi(optarg);
+        else if (opt == 'M' && atoi(optarg) > 0)
+            metricsPort = optarg;
+        else
+            serverUsage(argc, argv);
+    }
+    diskConfigure(depth, policy);
+    fileCacheConfigure(cacheSize);
+    logConfigure(logRate);
+
+    // Check the number of command-line arguments
+    if (argc - optind < 2)
+    {
+        serverUsage(argc, argv);
+    }
+
+    // Initialize the socket address storage
+    struct sockaddr_storage storage;
+    if (0 != server_sockaddr_init(argv[optind], argv[optind + 1], &storage))
+    {
+        serverUsage(argc, argv);
+    }
+
+    raiseFileLimit();
+
+    // Keep log lines of concurrent workers whole
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    char addrstr[BUFSZ];
+    // Convert the socket address to a string representation
+    addrtostr((struct sockaddr *)(&storage), addrstr, BUFSZ);
+
+    if (workers > 0)
+    {
+        printf("Server on %s, %d workers, waiting\n", addrstr, workers);
+        runWorkers(&storage, workers, useUring, metricsPort);
+        exit(EXIT_FAILURE);
+    }
+
+    int s = openListener(&storage, 0);
+    struct WorkerStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    printf("Server on %s, waiting\n", addrstr);
+
+    if (metricsPort != NULL && metricsStart(metricsPort, &stats, 1) != 0)
+    {
+        printf("cannot serve metrics on port %s\n", metricsPort);
+    }
+
+    serve(s, &stats, useUring);
+
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
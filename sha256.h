@@ -0,0 +1,27 @@
+#ifndef SHA256_H
+#define SHA256_H
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+// Incremental SHA-256 state
+struct Sha256
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t blockLength;
+};
+
+void sha256Init(struct Sha256 *ctx);
+
+void sha256Update(struct Sha256 *ctx, const void *data, size_t length);
+
+void sha256Final(struct Sha256 *ctx, unsigned char digest[SHA256_SIZE]);
+
+void sha256Hex(const unsigned char digest[SHA256_SIZE], char hex[2 * SHA256_SIZE + 1]);
+
+#endif
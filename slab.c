@@ -0,0 +1,55 @@
+#include "slab.h"
+
+#include <stdlib.h>
+
+/*
+ * Prepare a slab of objects of `size` bytes, rounded up to whole cache
+ * lines, allocated `perPage` at a time.
+ */
+void slabInit(struct Slab *slab, size_t size, size_t perPage)
+{
+    slab->size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    slab->perPage = perPage;
+    slab->free = NULL;
+}
+
+/*
+ * Take an object from the free list, allocating a new page when it is
+ * empty. The object keeps whatever its previous user left in it.
+ * Returns NULL if there is no memory left.
+ */
+void *slabAlloc(struct Slab *slab)
+{
+    if (slab->free == NULL)
+    {
+        char *page = aligned_alloc(CACHE_LINE, slab->size * slab->perPage);
+        if (page == NULL)
+        {
+            return NULL;
+        }
+        // Thread the new objects on the free list, the first one on top
+        for (size_t i = slab->perPage; i > 0; i--)
+        {
+            void **object = (void **)(page + (i - 1) * slab->size);
+            *object = slab->free;
+            slab->free = object;
+        }
+    }
+
+    void **object = slab->free;
+    slab->free = *object;
+    return object;
+}
+
+/*
+ * Give an object back to its slab.
+ */
+void slabFree(struct Slab *slab, void *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+    *(void **)object = slab->free;
+    slab->free = object;
+}
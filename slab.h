@@ -0,0 +1,28 @@
+#ifndef SLAB_H
+#define SLAB_H
+#pragma once
+
+#include <stddef.h>
+
+#define CACHE_LINE 64
+
+/*
+ * Allocator of fixed-size objects for one worker, without any locking.
+ * Objects are carved from pages, aligned on a cache line, and go back to a
+ * free list when released, so the memory of a worker stays at its peak
+ * number of objects in use and is reused as is, never cleared.
+ */
+struct Slab
+{
+    size_t size;
+    size_t perPage;
+    void *free;
+};
+
+void slabInit(struct Slab *slab, size_t size, size_t perPage);
+
+void *slabAlloc(struct Slab *slab);
+
+void slabFree(struct Slab *slab, void *object);
+
+#endif
@@ -0,0 +1,90 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * Allocate one zeroed WorkerStats per worker in memory that stays shared
+ * with the processes forked afterwards.
+ * Returns NULL on failure.
+ */
+struct WorkerStats *statsCreate(int workers)
+{
+    void *stats = mmap(NULL, workers * sizeof(struct WorkerStats), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED)
+    {
+        return NULL;
+    }
+    memset(stats, 0, workers * sizeof(struct WorkerStats));
+    return stats;
+}
+
+/*
+ * Monotonic time in microseconds, to measure durations.
+ */
+uint64_t statsMicros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Print the throughput and the hot-file cache activity of every worker
+ * since the previous report, then the total, and remember the current
+ * counters in `previous`.
+ * Nothing is printed if no worker received or looked up anything.
+ */
+void statsReport(const struct WorkerStats *stats, struct WorkerStats *previous,
+                 int workers, double seconds)
+{
+    struct WorkerStats current[workers];
+    uint64_t totalFiles = 0;
+    uint64_t totalBytes = 0;
+    uint64_t totalLookups = 0;
+
+    for (int i = 0; i < workers; i++)
+    {
+        current[i].connections = __atomic_load_n(&stats[i].connections, __ATOMIC_RELAXED);
+        current[i].files = __atomic_load_n(&stats[i].files, __ATOMIC_RELAXED);
+        current[i].bytesReceived = __atomic_load_n(&stats[i].bytesReceived, __ATOMIC_RELAXED);
+        current[i].syscalls = __atomic_load_n(&stats[i].syscalls, __ATOMIC_RELAXED);
+        current[i].cacheHits = __atomic_load_n(&stats[i].cacheHits, __ATOMIC_RELAXED);
+        current[i].cacheMisses = __atomic_load_n(&stats[i].cacheMisses, __ATOMIC_RELAXED);
+        current[i].cacheEvictions = __atomic_load_n(&stats[i].cacheEvictions, __ATOMIC_RELAXED);
+        totalFiles += current[i].files - previous[i].files;
+        totalBytes += current[i].bytesReceived - previous[i].bytesReceived;
+        totalLookups += current[i].cacheHits - previous[i].cacheHits +
+                        current[i].cacheMisses - previous[i].cacheMisses;
+    }
+
+    if (totalFiles == 0 && totalBytes == 0 && totalLookups == 0)
+    {
+        memcpy(previous, current, sizeof(current));
+        return;
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        uint64_t files = current[i].files - previous[i].files;
+        uint64_t bytes = current[i].bytesReceived - previous[i].bytesReceived;
+        uint64_t syscalls = current[i].syscalls - previous[i].syscalls;
+        printf("worker %d: %llu connections, %.1f files/s, %.2f MB/s, %.1f syscalls/MB\n", i,
+               (unsigned long long)(current[i].connections - previous[i].connections),
+               files / seconds, bytes / seconds / 1e6, bytes ? syscalls / (bytes / 1e6) : 0.0);
+        if (totalLookups > 0)
+        {
+            printf("worker %d: cache %llu hits, %llu misses, %llu evictions\n", i,
+                   (unsigned long long)(current[i].cacheHits - previous[i].cacheHits),
+                   (unsigned long long)(current[i].cacheMisses - previous[i].cacheMisses),
+                   (unsigned long long)(current[i].cacheEvictions - previous[i].cacheEvictions));
+        }
+    }
+    printf("total: %.1f files/s, %.2f MB/s\n", totalFiles / seconds, totalBytes / seconds / 1e6);
+    fflush(stdout);
+
+    memcpy(previous, current, sizeof(current));
+}
@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+#pragma once
+
+#include <stdint.h>
+
+// Seconds between two throughput reports of a multi-worker server
+#define REPORT_INTERVAL 5
+
+// Buckets of a histogram, the last one counting everything larger
+#define HISTOGRAM_BUCKETS 32
+
+/*
+ * Distribution of a value in powers of two: bucket i counts the values up
+ * to 2^i.
+ */
+struct Histogram
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t sum;
+    uint64_t count;
+};
+
+/*
+ * Counters of one worker. Each worker owns its cache lines so they can be
+ * updated without sharing or locking, and read by the parent process and
+ * the metrics endpoint. Gauges written by other threads of the worker are
+ * stored atomically.
+ */
+struct WorkerStats
+{
+    uint64_t connections;
+    uint64_t files;
+    uint64_t bytesReceived;
+    uint64_t syscalls;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t cacheEvictions;
+    uint64_t bytesSent;
+    uint64_t downloads;
+    uint64_t openConnections;
+    uint64_t diskQueued;
+    uint64_t logDropped;
+    uint64_t badChunks;
+    struct Histogram recvSizes;
+    struct Histogram transferMicros;
+} __attribute__((aligned(64)));
+
+/*
+ * Count a value in its histogram.
+ */
+static inline void statsObserve(struct Histogram *histogram, uint64_t value)
+{
+    int bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+    histogram->buckets[bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1]++;
+    histogram->sum += value;
+    histogram->count++;
+}
+
+uint64_t statsMicros(void);
+
+struct WorkerStats *statsCreate(int workers);
+
+void statsReport(const struct WorkerStats *stats, struct WorkerStats *previous,
+                 int workers, double seconds);
+
+#endif
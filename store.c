@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+
+#include "store.h"
+#include "disk.h"
+#include "protocol.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define STORE_PATHSZ (sizeof(STORE_DIR) + 2 * SHA256_SIZE + 1)
+
+/*
+ * Build the path of a content in the store.
+ */
+static void storePath(const unsigned char digest[SHA256_SIZE], char path[STORE_PATHSZ])
+{
+    char hex[2 * SHA256_SIZE + 1];
+    sha256Hex(digest, hex);
+    snprintf(path, STORE_PATHSZ, "%s/%s", STORE_DIR, hex);
+}
+
+/*
+ * Create the store directory in the working directory, the first time a
+ * file is added to it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int createStore(void)
+{
+    static int created;
+    if (__atomic_load_n(&created, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    if (mkdir(STORE_DIR, 0755) != 0 && errno != EEXIST)
+    {
+        return -1;
+    }
+    __atomic_store_n(&created, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Compute the SHA-256 of the content of a file, read from its start.
+ * Returns 0 on success, -1 on failure.
+ */
+static int hashFile(int fd, unsigned char digest[SHA256_SIZE])
+{
+    char chunk[CHUNKSZ];
+    struct Sha256 ctx;
+    sha256Init(&ctx);
+    ssize_t count;
+    off_t offset = 0;
+    while ((count = pread(fd, chunk, CHUNKSZ, offset)) > 0)
+    {
+        sha256Update(&ctx, chunk, count);
+        offset += count;
+    }
+    sha256Final(&ctx, digest);
+    return count < 0 ? -1 : 0;
+}
+
+/*
+ * Give the file open as fd the name `name` too, without copying it.
+ * Returns 0 on success, -1 on failure.
+ */
+static int linkOpen(int fd, const char *name)
+{
+    char procName[32];
+    snprintf(procName, sizeof(procName), "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, procName, AT_FDCWD, name, AT_SYMLINK_FOLLOW) == 0 ? 0 : -1;
+}
+
+/*
+ * Fill target, opened for writing, with the content of source: a reflink
+ * when the file system can share extents, and a copy otherwise. Only used
+ * when source cannot be linked.
+ * Returns 0 on success, -1 on failure.
+ */
+static int copyContent(int source, int target)
+{
+    if (ioctl(target, FICLONE, source) == 0)
+    {
+        return 0;
+    }
+    char chunk[CHUNKSZ];
+    ssize_t count;
+    off_t offset = 0;
+    while ((count = pread(source, chunk, CHUNKSZ, offset)) > 0)
+    {
+        if (writeAll(target, chunk, count) != 0)
+        {
+            return -1;
+        }
+        offset += count;
+    }
+    return count < 0 ? -1 : 0;
+}
+
+/*
+ * Remove the entries no file shares any more, whose link count is down to
+ * the store's own, once their inode did not change for STORE_EXPIRY
+ * seconds. A use or the removal of the last other name changes it. The disk
+ * threads of a worker check at most every STORE_SWEEP_INTERVAL seconds.
+ */
+static void sweepStore(void)
+{
+    static time_t lastSweep;
+    time_t now = time(NULL);
+    time_t last = __atomic_load_n(&lastSweep, __ATOMIC_RELAXED);
+    if (now - last < STORE_SWEEP_INTERVAL ||
+        !__atomic_compare_exchange_n(&lastSweep, &last, now, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    DIR *dir = opendir(STORE_DIR);
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (entry->d_name[0] != '.' && fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 &&
+            S_ISREG(st.st_mode) && st.st_nlink == 1 && now - st.st_ctime > STORE_EXPIRY)
+        {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Create `name` with the stored content of the digest. The entry is first
+ * checked against its digest, since a file sharing its inode may have been
+ * written in place, and dropped if it no longer matches. The file is then
+ * linked to the entry, or as a fallback reflinked or copied from it, under
+ * the private tmpName and renamed over name, so an existing file is
+ * replaced atomically. Reads whole files, so it runs on a disk thread.
+ * Returns 0 on success, -1 if the content is not stored or on failure.
+ */
+int storeLink(const unsigned char digest[SHA256_SIZE], const char *name, const char *tmpName)
+{
+    char path[STORE_PATHSZ];
+    storePath(digest, path);
+
+    int source = open(path, O_RDONLY | O_CLOEXEC);
+    if (source == -1)
+    {
+        return -1;
+    }
+
+    unsigned char stored[SHA256_SIZE];
+    struct stat st;
+    if (hashFile(source, stored) != 0 || memcmp(stored, digest, SHA256_SIZE) != 0 ||
+        fstat(source, &st) != 0)
+    {
+        unlink(path);
+        close(source);
+        return -1;
+    }
+    // An entry only the store holds is marked as used, see sweepStore
+    if (st.st_nlink == 1)
+    {
+        futimens(source, NULL);
+    }
+
+    int failed = 0;
+    if (linkOpen(source, tmpName) != 0)
+    {
+        int target = open(tmpName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        failed = target == -1 || copyContent(source, target) != 0 ||
+                 (diskSyncPolicy() != SYNC_NONE && fdatasync(target) != 0);
+        if (target != -1)
+        {
+            close(target);
+        }
+    }
+    close(source);
+
+    // When name already is a link to the stored content, rename leaves both
+    // names in place, so tmpName is removed either way
+    failed = failed || rename(tmpName, name) != 0;
+    unlink(tmpName);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Add the content of a stored copy that could not be linked: an unnamed
+ * file in the store, or a named one if the file system has no O_TMPFILE,
+ * reflinked or copied from source and linked in under its digest.
+ * Returns 0 on success, -1 on failure.
+ */
+static int addCopy(int source, const char *path)
+{
+    char tmpName[STORE_PATHSZ];
+    tmpName[0] = '\0';
+    int entry = open(STORE_DIR, O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+    if (entry == -1 && (errno == EOPNOTSUPP || errno == EISDIR))
+    {
+        snprintf(tmpName, STORE_PATHSZ, "%s/tmpXXXXXX", STORE_DIR);
+        entry = mkostemp(tmpName, O_CLOEXEC);
+    }
+    if (entry == -1)
+    {
+        return -1;
+    }
+
+    int failed = copyContent(source, entry) != 0;
+    if (!failed)
+    {
+        int linked = tmpName[0] != '\0' ? link(tmpName, path) : linkOpen(entry, path);
+        failed = linked != 0 && errno != EEXIST;
+    }
+    if (tmpName[0] != '\0')
+    {
+        unlink(tmpName);
+    }
+    close(entry);
+    return failed ? -1 : 0;
+}
+
+/*
+ * Hash a received file and add it to the store, as a hard link to the
+ * very inode that was hashed. The digest is computed from the file itself,
+ * never taken from the client, so the store cannot be poisoned with content
+ * that does not match its name; the server never writes a received file in
+ * place, and storeLink checks the digest again before using an entry. Reads
+ * the whole file, so it runs on a disk thread.
+ * Returns 0 on success, -1 on failure.
+ */
+int storeAdd(const char *name)
+{
+    int source = createStore() == 0 ? open(name, O_RDONLY | O_CLOEXEC) : -1;
+    if (source == -1)
+    {
+        return -1;
+    }
+
+    unsigned char digest[SHA256_SIZE];
+    char path[STORE_PATHSZ];
+    int failed = hashFile(source, digest) != 0;
+    storePath(digest, path);
+
+    // A file replaced since it was opened cannot be linked any more
+    if (!failed && linkOpen(source, path) != 0 && errno != EEXIST)
+    {
+        failed = addCopy(source, path) != 0;
+    }
+    close(source);
+    sweepStore();
+    return failed ? -1 : 0;
+}
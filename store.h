@@ -0,0 +1,22 @@
+#ifndef STORE_H
+#define STORE_H
+#pragma once
+
+#include "sha256.h"
+
+// Directory of the content store, one hard link per distinct content named
+// by its SHA-256, created with the first entry, so a server nobody uses
+// deduplication with never has one. Not a valid file name for clients, so it
+// cannot be clobbered.
+#define STORE_DIR ".store"
+
+// Entries no file links to any more are removed once unused for this many
+// seconds, checked at most every STORE_SWEEP_INTERVAL seconds
+#define STORE_EXPIRY (24 * 60 * 60)
+#define STORE_SWEEP_INTERVAL 600
+
+int storeLink(const unsigned char digest[SHA256_SIZE], const char *name, const char *tmpName);
+
+int storeAdd(const char *name);
+
+#endif
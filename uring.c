@@ -0,0 +1,648 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "connection.h"
+#include "log.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define RING_ENTRIES 4096
+
+// Buffers the kernel picks from when a client sends headers or small payloads
+#define RECV_BUFFERS 512
+#define RECV_BUFSZ (16 * 1024)
+#define RECV_GROUP 0
+
+// Registered buffers for the linked receive and file write of large payloads
+#define FIXED_BUFFERS 16
+#define FIXED_BUFSZ (1024 * 1024)
+
+// Operation kinds, stored in the low bits of the user data
+enum UringOp
+{
+    UOP_ACCEPT,
+    UOP_RECV,
+    UOP_LINKED_RECV,
+    UOP_WRITE,
+    UOP_SEND,
+    UOP_PROVIDE
+};
+#define UOP_MASK 7
+
+/*
+ * Submission and completion queues shared with the kernel
+ */
+struct Ring
+{
+    int fd;
+    unsigned entries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned sqeTail;
+    unsigned submitted;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+};
+
+/*
+ * io_uring state of one client: operations in flight, the registered
+ * buffer it holds while a linked receive and write are queued, and its
+ * place in the list of clients waiting for a receive buffer
+ */
+struct UringConn
+{
+    struct Connection *conn;
+    int ops;
+    int reading;
+    int sending;
+    int closing;
+    int parked;
+    struct UringConn *nextParked;
+    int buffer;
+    size_t linkedLength;
+    ssize_t linkedReceived;
+};
+
+struct UringWorker
+{
+    struct Ring ring;
+    struct WorkerStats *stats;
+    int listener;
+    struct sockaddr_storage acceptAddr;
+    socklen_t acceptAddrLength;
+    char *recvBuffers;
+    char *fixedBuffers;
+    int freeFixed[FIXED_BUFFERS];
+    int freeCount;
+    struct UringConn *parked;
+    int recycled;
+    struct ConnectionPool pool;
+    struct Slab uringConns;
+    struct FileCache *cache;
+};
+
+/*
+ * Create the ring and map its queues.
+ * Returns 0 on success, -1 if the kernel does not support io_uring.
+ */
+static int ringInit(struct Ring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap)
+    {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    char *cq = sq;
+    if (!singleMap)
+    {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->entries = params.sq_entries;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sqeTail = *ring->sqTail;
+    ring->submitted = ring->sqeTail;
+    return 0;
+}
+
+/*
+ * Publish the queued entries and optionally wait for completions.
+ * Returns the result of io_uring_enter.
+ */
+static int ringSubmit(struct Ring *ring, unsigned waitFor, struct WorkerStats *stats)
+{
+    unsigned toSubmit = ring->sqeTail - ring->submitted;
+    __atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+    ring->submitted = ring->sqeTail;
+
+    stats->syscalls++;
+    return syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor,
+                   waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * Get `count` consecutive zeroed submission entries, submitting the queue
+ * first if they do not fit, so linked entries are never split.
+ */
+static struct io_uring_sqe *ringGetSqes(struct Ring *ring, unsigned count,
+                                        struct WorkerStats *stats)
+{
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqeTail + count - head > ring->entries)
+    {
+        ringSubmit(ring, 0, stats);
+    }
+
+    struct io_uring_sqe *first = NULL;
+    for (unsigned i = 0; i < count; i++)
+    {
+        unsigned index = ring->sqeTail & *ring->sqMask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        ring->sqArray[index] = index;
+        ring->sqeTail++;
+        if (first == NULL)
+        {
+            first = sqe;
+        }
+    }
+    return first;
+}
+
+/*
+ * Next entry of a pair obtained with ringGetSqes, following ring order.
+ */
+static struct io_uring_sqe *ringNextSqe(struct Ring *ring, struct io_uring_sqe *sqe)
+{
+    unsigned index = (unsigned)(sqe - ring->sqes);
+    return &ring->sqes[(index + 1) & *ring->sqMask];
+}
+
+static uint64_t userData(struct UringConn *uc, enum UringOp op)
+{
+    return (uint64_t)(uintptr_t)uc | op;
+}
+
+/*
+ * Give one receive buffer, or all of them when `bid` is -1, back to the
+ * kernel's buffer group.
+ */
+static void provideBuffers(struct UringWorker *w, int bid)
+{
+    struct io_uring_sqe *sqe = ringGetSqes(&w->ring, 1, w->stats);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = bid == -1 ? RECV_BUFFERS : 1;
+    sqe->addr = (uintptr_t)(w->recvBuffers + (bid == -1 ? 0 : (size_t)bid * RECV_BUFSZ));
+    sqe->len = RECV_BUFSZ;
+    sqe->off = bid == -1 ? 0 : bid;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = userData(NULL, UOP_PROVIDE);
+}
+
+static void postAccept(struct UringWorker *w)
+{
+    struct io_uring_sqe *sqe = ringGetSqes(&w->ring, 1, w->stats);
+    w->acceptAddrLength = sizeof(w->acceptAddr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listener;
+    sqe->addr = (uintptr_t)&w->acceptAddr;
+    sqe->addr2 = (uintptr_t)&w->acceptAddrLength;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = userData(NULL, UOP_ACCEPT);
+}
+
+/*
+ * Queue the next read of a client. Large payloads are received into a
+ * registered buffer by a receive linked to the file write that consumes it;
+ * everything else, checked payloads included, lands in a buffer picked by
+ * the kernel and goes through the connection state machine.
+ */
+static void postRead(struct UringWorker *w, struct UringConn *uc)
+{
+    struct Connection *conn = uc->conn;
+
+    if (conn->state == STATE_PAYLOAD && !conn->writeFailed && !conn->checked &&
+        conn->remaining >= SPLICE_MIN && w->freeCount > 0)
+    {
+        int buffer = w->freeFixed[--w->freeCount];
+        char *data = w->fixedBuffers + (size_t)buffer * FIXED_BUFSZ;
+        size_t length = conn->remaining < FIXED_BUFSZ ? (size_t)conn->remaining : FIXED_BUFSZ;
+
+        struct io_uring_sqe *recvSqe = ringGetSqes(&w->ring, 2, w->stats);
+        recvSqe->opcode = IORING_OP_RECV;
+        recvSqe->fd = conn->socket;
+        recvSqe->addr = (uintptr_t)data;
+        recvSqe->len = length;
+        recvSqe->msg_flags = MSG_WAITALL;
+        recvSqe->flags = IOSQE_IO_LINK;
+        recvSqe->user_data = userData(uc, UOP_LINKED_RECV);
+
+        // Offset -1 writes at, and advances, the file position
+        struct io_uring_sqe *writeSqe = ringNextSqe(&w->ring, recvSqe);
+        writeSqe->opcode = IORING_OP_WRITE_FIXED;
+        writeSqe->fd = conn->file;
+        writeSqe->addr = (uintptr_t)data;
+        writeSqe->len = length;
+        writeSqe->off = (uint64_t)-1;
+        writeSqe->buf_index = buffer;
+        writeSqe->user_data = userData(uc, UOP_WRITE);
+
+        uc->buffer = buffer;
+        uc->linkedLength = length;
+        uc->linkedReceived = -1;
+        uc->ops += 2;
+        uc->reading = 1;
+        return;
+    }
+
+    struct io_uring_sqe *sqe = ringGetSqes(&w->ring, 1, w->stats);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->len = RECV_BUFSZ;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = userData(uc, UOP_RECV);
+    uc->ops++;
+    uc->reading = 1;
+}
+
+static void postSend(struct UringWorker *w, struct UringConn *uc)
+{
+    struct Connection *conn = uc->conn;
+    struct io_uring_sqe *sqe = ringGetSqes(&w->ring, 1, w->stats);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->socket;
+    sqe->addr = (uintptr_t)(conn->out + conn->outSent);
+    sqe->len = conn->outLength - conn->outSent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData(uc, UOP_SEND);
+    uc->ops++;
+    uc->sending = 1;
+}
+
+/*
+ * Leave a client out of the receives until a receive buffer is given back.
+ */
+static void park(struct UringWorker *w, struct UringConn *uc)
+{
+    uc->parked = 1;
+    uc->reading = 1;
+    uc->nextParked = w->parked;
+    w->parked = uc;
+}
+
+static void unpark(struct UringWorker *w, struct UringConn *uc)
+{
+    struct UringConn **link = &w->parked;
+    while (*link != uc)
+    {
+        link = &(*link)->nextParked;
+    }
+    *link = uc->nextParked;
+    uc->parked = 0;
+    uc->reading = 0;
+}
+
+static void releaseFixed(struct UringWorker *w, struct UringConn *uc)
+{
+    if (uc->buffer != -1)
+    {
+        w->freeFixed[w->freeCount++] = uc->buffer;
+        uc->buffer = -1;
+    }
+}
+
+/*
+ * Decide what a client needs next once an operation completed: send the
+ * queued replies or the next piece of a download, read more, or close once
+ * nothing is in flight. Reads are not posted while a send is in flight,
+ * because feeding new bytes may grow (and move) the output buffer the
+ * kernel is sending from, nor during a download.
+ */
+static void advance(struct UringWorker *w, struct UringConn *uc)
+{
+    struct Connection *conn = uc->conn;
+
+    if (!uc->closing && !uc->sending && connectionFillOutput(conn) != 0)
+    {
+        uc->closing = 1;
+    }
+    if (!uc->closing && !uc->sending && connectionPendingOutput(conn) > 0)
+    {
+        postSend(w, uc);
+    }
+    if (!uc->closing && !uc->sending && !uc->reading && conn->state != STATE_CLOSING &&
+        conn->state != STATE_SENDING)
+    {
+        postRead(w, uc);
+    }
+
+    int finished = uc->closing ||
+                   (conn->state == STATE_CLOSING && connectionPendingOutput(conn) == 0);
+    if (finished && uc->ops == 0)
+    {
+        if (uc->parked)
+        {
+            unpark(w, uc);
+        }
+        releaseFixed(w, uc);
+        connectionDestroy(conn);
+        slabFree(&w->uringConns, uc);
+    }
+}
+
+static void onAccept(struct UringWorker *w, int res)
+{
+    if (res >= 0)
+    {
+        struct Connection *conn = connectionCreate(&w->pool, res,
+                                                   (struct sockaddr *)&w->acceptAddr, w->stats);
+        struct UringConn *uc = conn != NULL ? slabAlloc(&w->uringConns) : NULL;
+        if (uc == NULL)
+        {
+            if (conn != NULL)
+                connectionDestroy(conn);
+            else
+                close(res);
+        }
+        else
+        {
+            *uc = (struct UringConn){.conn = conn, .buffer = -1};
+            conn->cache = w->cache;
+            advance(w, uc);
+        }
+    }
+    else if (res == -EMFILE || res == -ENFILE)
+    {
+        logPrintf("too many open files, client left in the backlog\n");
+    }
+    postAccept(w);
+}
+
+/*
+ * Give a consumed receive buffer back to the kernel. Each buffer given back
+ * lets one waiting client retry its receive, see wakeParked.
+ */
+static void recycleBuffer(struct UringWorker *w, int bid)
+{
+    provideBuffers(w, bid);
+    if (w->recycled < RECV_BUFFERS)
+    {
+        w->recycled++;
+    }
+}
+
+/*
+ * Post the receives of the clients that waited longest for a buffer, one
+ * per buffer given back since, once the buffers are queued ahead of them.
+ * A buffer given back before its client was parked still counts, so a
+ * client is never left waiting while buffers are free.
+ */
+static void wakeParked(struct UringWorker *w)
+{
+    while (w->parked != NULL && w->recycled > 0)
+    {
+        // The list is pushed at its head, so the oldest client is at its tail
+        struct UringConn *uc = w->parked;
+        while (uc->nextParked != NULL)
+        {
+            uc = uc->nextParked;
+        }
+        w->recycled--;
+        unpark(w, uc);
+        advance(w, uc);
+    }
+}
+
+static void onRecv(struct UringWorker *w, struct UringConn *uc, int res, unsigned flags)
+{
+    uc->reading = 0;
+
+    if (res == -ENOBUFS)
+    {
+        // Every receive buffer is in use; retrying at once would only spin
+        // on completions, so the receive waits for one to be given back
+        park(w, uc);
+        advance(w, uc);
+        return;
+    }
+    if (res <= 0)
+    {
+        uc->closing = 1;
+        advance(w, uc);
+        return;
+    }
+
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    statsObserve(&w->stats->recvSizes, res);
+    if (connectionFeed(uc->conn, w->recvBuffers + (size_t)bid * RECV_BUFSZ, res) != 0)
+    {
+        uc->closing = 1;
+    }
+    recycleBuffer(w, bid);
+    advance(w, uc);
+}
+
+static void onWrite(struct UringWorker *w, struct UringConn *uc, int res)
+{
+    struct Connection *conn = uc->conn;
+
+    if (res == -ECANCELED)
+    {
+        if (uc->linkedReceived > 0)
+        {
+            // The receive came up short and broke the link: write what arrived
+            uc->linkedLength = uc->linkedReceived;
+            uc->linkedReceived = uc->linkedLength;
+
+            struct io_uring_sqe *sqe = ringGetSqes(&w->ring, 1, w->stats);
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->fd = conn->file;
+            sqe->addr = (uintptr_t)(w->fixedBuffers + (size_t)uc->buffer * FIXED_BUFSZ);
+            sqe->len = uc->linkedLength;
+            sqe->off = (uint64_t)-1;
+            sqe->buf_index = uc->buffer;
+            sqe->user_data = userData(uc, UOP_WRITE);
+            uc->ops++;
+            return;
+        }
+        uc->closing = 1;
+    }
+    else
+    {
+        statsObserve(&w->stats->recvSizes, uc->linkedLength);
+        if (res < 0 || (size_t)res != uc->linkedLength)
+        {
+            conn->writeFailed = 1;
+        }
+        if (connectionPayloadWritten(conn, uc->linkedLength) != 0)
+        {
+            uc->closing = 1;
+        }
+    }
+
+    uc->reading = 0;
+    releaseFixed(w, uc);
+    advance(w, uc);
+}
+
+static void onSend(struct UringWorker *w, struct UringConn *uc, int res)
+{
+    struct Connection *conn = uc->conn;
+    uc->sending = 0;
+
+    if (res <= 0)
+    {
+        uc->closing = 1;
+    }
+    else
+    {
+        conn->outSent += res;
+        conn->stats->bytesSent += res;
+        if (conn->outSent == conn->outLength)
+        {
+            conn->outSent = 0;
+            conn->outLength = 0;
+        }
+    }
+    advance(w, uc);
+}
+
+/*
+ * Allocate the receive buffers and register the fixed ones with the ring.
+ * Returns 0 on success, -1 on failure.
+ */
+static int setupBuffers(struct UringWorker *w)
+{
+    w->recvBuffers = malloc((size_t)RECV_BUFFERS * RECV_BUFSZ);
+    w->fixedBuffers = malloc((size_t)FIXED_BUFFERS * FIXED_BUFSZ);
+    if (w->recvBuffers == NULL || w->fixedBuffers == NULL)
+    {
+        return -1;
+    }
+
+    struct iovec iov[FIXED_BUFFERS];
+    for (int i = 0; i < FIXED_BUFFERS; i++)
+    {
+        iov[i].iov_base = w->fixedBuffers + (size_t)i * FIXED_BUFSZ;
+        iov[i].iov_len = FIXED_BUFSZ;
+        w->freeFixed[i] = i;
+    }
+    w->freeCount = FIXED_BUFFERS;
+
+    if (syscall(__NR_io_uring_register, w->ring.fd, IORING_REGISTER_BUFFERS, iov,
+                FIXED_BUFFERS) != 0)
+    {
+        return -1;
+    }
+    provideBuffers(w, -1);
+    return 0;
+}
+
+/*
+ * Serve clients from one thread with io_uring: receives, file writes and
+ * replies are queued in the ring and submitted together, one io_uring_enter
+ * per batch of completions.
+ * Returns -1 right away if the kernel does not support io_uring, otherwise
+ * never returns.
+ */
+int runUringLoop(int s, struct WorkerStats *stats)
+{
+    static struct UringWorker w;
+
+    w.stats = stats;
+    w.listener = s;
+    connectionPoolInit(&w.pool);
+    slabInit(&w.uringConns, sizeof(struct UringConn), 64);
+    if (ringInit(&w.ring, RING_ENTRIES) != 0)
+    {
+        return -1;
+    }
+    if (setupBuffers(&w) != 0)
+    {
+        close(w.ring.fd);
+        return -1;
+    }
+    w.cache = fileCacheCreate(stats);
+    postAccept(&w);
+
+    while (1)
+    {
+        if (ringSubmit(&w.ring, 1, stats) < 0 && errno != EINTR)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        unsigned head = *w.ring.cqHead;
+        unsigned tail = __atomic_load_n(w.ring.cqTail, __ATOMIC_ACQUIRE);
+
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &w.ring.cqes[head & *w.ring.cqMask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            head++;
+            __atomic_store_n(w.ring.cqHead, head, __ATOMIC_RELEASE);
+
+            struct UringConn *uc = (struct UringConn *)(uintptr_t)(data & ~(uint64_t)UOP_MASK);
+            switch (data & UOP_MASK)
+            {
+            case UOP_ACCEPT:
+                onAccept(&w, res);
+                break;
+            case UOP_RECV:
+                uc->ops--;
+                onRecv(&w, uc, res, flags);
+                break;
+            case UOP_LINKED_RECV:
+                uc->ops--;
+                uc->linkedReceived = res;
+                break;
+            case UOP_WRITE:
+                uc->ops--;
+                onWrite(&w, uc, res);
+                break;
+            case UOP_SEND:
+                uc->ops--;
+                onSend(&w, uc, res);
+                break;
+            case UOP_PROVIDE:
+                break;
+            }
+
+            tail = __atomic_load_n(w.ring.cqTail, __ATOMIC_ACQUIRE);
+        }
+        wakeParked(&w);
+    }
+}
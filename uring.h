@@ -0,0 +1,9 @@
+#ifndef URING_H
+#define URING_H
+#pragma once
+
+#include "stats.h"
+
+int runUringLoop(int s, struct WorkerStats *stats);
+
+#endif